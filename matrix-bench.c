@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 1999-2001  Brian Paul   All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * BRIAN PAUL BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmark comparing the matrix functions in matrix.c with the
+ * original ones from stereo-es2gears.c, which are copied below.
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "matrix.h"
+
+#define ITERATIONS 2000000
+
+/* Stops the compiler from optimising away the benchmarked work */
+static volatile float sink;
+
+static void
+legacy_multiply(float * m, const float * n)
+{
+   float tmp[16];
+   const float *row, *column;
+   div_t d;
+   int i, j;
+
+   for (i = 0; i < 16; i++) {
+      tmp[i] = 0;
+      d = div(i, 4);
+      row = n + d.quot * 4;
+      column = m + d.rem;
+      for (j = 0; j < 4; j++)
+         tmp[i] += row[j] * column[j * 4];
+   }
+   memcpy(m, &tmp, sizeof tmp);
+}
+
+static void
+legacy_rotate(float * m, float angle, float x, float y, float z)
+{
+   double s, c;
+
+   sincos(angle, &s, &c);
+   float r[16] = {
+      x * x * (1 - c) + c, y * x * (1 - c) + z * s,
+      x * z * (1 - c) - y * s, 0,
+      x * y * (1 - c) - z * s, y * y * (1 - c) + c,
+      y * z * (1 - c) + x * s, 0,
+      x * z * (1 - c) + y * s, y * z * (1 - c) - x * s,
+      z * z * (1 - c) + c, 0,
+      0, 0, 0, 1
+   };
+
+   legacy_multiply(m, r);
+}
+
+static void
+legacy_translate(float * m, float x, float y, float z)
+{
+   float t[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, x, y, z, 1 };
+
+   legacy_multiply(m, t);
+}
+
+static void
+legacy_identity(float * m)
+{
+   float t[16] = {
+      1.0, 0.0, 0.0, 0.0,
+      0.0, 1.0, 0.0, 0.0,
+      0.0, 0.0, 1.0, 0.0,
+      0.0, 0.0, 0.0, 1.0,
+   };
+
+   memcpy(m, t, sizeof(t));
+}
+
+static void
+legacy_transpose(float * m)
+{
+   float t[16] = {
+      m[0], m[4], m[8], m[12],
+      m[1], m[5], m[9], m[13],
+      m[2], m[6], m[10], m[14],
+      m[3], m[7], m[11], m[15]
+   };
+
+   memcpy(m, t, sizeof(t));
+}
+
+static void
+legacy_invert(float * m)
+{
+   float t[16];
+   legacy_identity(t);
+
+   t[12] = -m[12];
+   t[13] = -m[13];
+   t[14] = -m[14];
+
+   m[12] = m[13] = m[14] = 0;
+   legacy_transpose(m);
+
+   legacy_multiply(m, t);
+}
+
+static double
+get_time(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+make_view(float *view, float *projection)
+{
+   matrix_identity(view);
+   matrix_translate(view, 0, 0, -20);
+   matrix_rotate(view, 0.3, 1, 0, 0);
+   matrix_rotate(view, 0.5, 0, 1, 0);
+
+   matrix_frustum(projection, -0.6, 0.4, -0.56, 0.56, 1.0, 1024.0);
+}
+
+/* The work that draw_gear() did for one gear and one eye */
+static void
+legacy_gear(const float *view, const float *projection, float angle,
+            float *mvp, float *normal)
+{
+   float model_view[16];
+
+   memcpy(model_view, view, sizeof model_view);
+   legacy_translate(model_view, -3.0, -2.0, 0);
+   legacy_rotate(model_view, angle, 0, 0, 1);
+
+   memcpy(normal, model_view, 16 * sizeof *normal);
+   legacy_invert(normal);
+   legacy_transpose(normal);
+
+   memcpy(mvp, projection, 16 * sizeof *mvp);
+   legacy_multiply(mvp, model_view);
+}
+
+/* The same work with the new functions */
+static void
+new_gear(const float *view, const float *projection, float angle,
+         float *mvp, float *normal)
+{
+   float model_view[16];
+
+   memcpy(model_view, view, sizeof model_view);
+   matrix_translate_rotate_z(model_view, -3.0, -2.0, angle);
+   matrix_normal(normal, model_view);
+   matrix_multiply(mvp, projection, model_view);
+}
+
+static float
+max_difference(const float *a, const float *b, int n)
+{
+   float max = 0.0f;
+   int i;
+
+   for (i = 0; i < n; i++) {
+      if (fabsf(a[i] - b[i]) > max)
+         max = fabsf(a[i] - b[i]);
+   }
+
+   return max;
+}
+
+static void
+check_results(void)
+{
+   float view[16], projection[16];
+   float legacy_mvp[16], legacy_normal[16], legacy_normal3[9];
+   float new_mvp[16], new_normal[9];
+   float a[16], b[16];
+   int i;
+
+   make_view(view, projection);
+
+   legacy_gear(view, projection, 0.7, legacy_mvp, legacy_normal);
+   new_gear(view, projection, 0.7, new_mvp, new_normal);
+
+   for (i = 0; i < 3; i++)
+      memcpy(legacy_normal3 + i * 3, legacy_normal + i * 4,
+             3 * sizeof(float));
+
+   memcpy(a, view, sizeof a);
+   memcpy(b, view, sizeof b);
+   legacy_rotate(a, 1.1, 0.6, 0.0, 0.8);
+   matrix_rotate(b, 1.1, 0.6, 0.0, 0.8);
+
+   printf("max difference: mvp %g, normal %g, rotate %g\n",
+          max_difference(legacy_mvp, new_mvp, 16),
+          max_difference(legacy_normal3, new_normal, 9),
+          max_difference(a, b, 16));
+}
+
+static void
+report(const char *name, double legacy_time, double new_time)
+{
+   printf("%-12s %8.1f ns %8.1f ns %6.2fx\n",
+          name,
+          legacy_time * 1e9 / ITERATIONS,
+          new_time * 1e9 / ITERATIONS,
+          legacy_time / new_time);
+}
+
+int
+main(void)
+{
+   float view[16], projection[16];
+   float m[16], n[16], normal[16];
+   double start, legacy_time, new_time;
+   int i;
+
+   printf("matrix implementation: %s\n", matrix_implementation());
+   check_results();
+
+   make_view(view, projection);
+   printf("%-12s %11s %11s %7s\n", "", "legacy", "new", "speedup");
+
+   memcpy(m, view, sizeof m);
+   start = get_time();
+   for (i = 0; i < ITERATIONS; i++)
+      legacy_multiply(m, projection);
+   legacy_time = get_time() - start;
+   sink = m[0];
+
+   memcpy(m, view, sizeof m);
+   start = get_time();
+   for (i = 0; i < ITERATIONS; i++)
+      matrix_multiply(m, m, projection);
+   new_time = get_time() - start;
+   sink = m[0];
+
+   report("multiply", legacy_time, new_time);
+
+   memcpy(m, view, sizeof m);
+   start = get_time();
+   for (i = 0; i < ITERATIONS; i++)
+      legacy_translate(m, 0.01, 0.02, 0.03);
+   legacy_time = get_time() - start;
+   sink = m[12];
+
+   memcpy(m, view, sizeof m);
+   start = get_time();
+   for (i = 0; i < ITERATIONS; i++)
+      matrix_translate(m, 0.01, 0.02, 0.03);
+   new_time = get_time() - start;
+   sink = m[12];
+
+   report("translate", legacy_time, new_time);
+
+   memcpy(m, view, sizeof m);
+   start = get_time();
+   for (i = 0; i < ITERATIONS; i++)
+      legacy_rotate(m, i * 1e-6f, 0, 0, 1);
+   legacy_time = get_time() - start;
+   sink = m[0];
+
+   memcpy(m, view, sizeof m);
+   start = get_time();
+   for (i = 0; i < ITERATIONS; i++)
+      matrix_rotate(m, i * 1e-6f, 0, 0, 1);
+   new_time = get_time() - start;
+   sink = m[0];
+
+   report("rotate", legacy_time, new_time);
+
+   start = get_time();
+   for (i = 0; i < ITERATIONS; i++) {
+      memcpy(n, view, sizeof n);
+      n[0] += i * 1e-9f;
+      legacy_invert(n);
+      legacy_transpose(n);
+      sink = n[0];
+   }
+   legacy_time = get_time() - start;
+
+   start = get_time();
+   for (i = 0; i < ITERATIONS; i++) {
+      memcpy(n, view, sizeof n);
+      n[0] += i * 1e-9f;
+      matrix_normal(normal, n);
+      sink = normal[0];
+   }
+   new_time = get_time() - start;
+
+   report("normal", legacy_time, new_time);
+
+   start = get_time();
+   for (i = 0; i < ITERATIONS; i++) {
+      legacy_gear(view, projection, i * 1e-6f, m, normal);
+      sink = m[0] + normal[0];
+   }
+   legacy_time = get_time() - start;
+
+   start = get_time();
+   for (i = 0; i < ITERATIONS; i++) {
+      new_gear(view, projection, i * 1e-6f, m, normal);
+      sink = m[0] + normal[0];
+   }
+   new_time = get_time() - start;
+
+   report("gear", legacy_time, new_time);
+
+   return EXIT_SUCCESS;
+}
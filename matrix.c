@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 1999-2001  Brian Paul   All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * BRIAN PAUL BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <string.h>
+
+#include "matrix.h"
+
+#if defined(MATRIX_NO_SIMD)
+#define MATRIX_SCALAR
+#elif defined(__AVX__)
+#define MATRIX_AVX
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#define MATRIX_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#define MATRIX_NEON
+#include <arm_neon.h>
+#else
+#define MATRIX_SCALAR
+#endif
+
+const char *
+matrix_implementation(void)
+{
+#if defined(MATRIX_AVX)
+   return "AVX";
+#elif defined(MATRIX_SSE2)
+   return "SSE2";
+#elif defined(MATRIX_NEON)
+   return "NEON";
+#else
+   return "scalar";
+#endif
+}
+
+void
+matrix_identity(float *m)
+{
+   static const float t[16] = {
+      1.0, 0.0, 0.0, 0.0,
+      0.0, 1.0, 0.0, 0.0,
+      0.0, 0.0, 1.0, 0.0,
+      0.0, 0.0, 0.0, 1.0,
+   };
+
+   memcpy(m, t, sizeof(t));
+}
+
+/*
+ * Each column j of the result is a linear combination of the columns of a
+ * weighted by the elements of column j of b. All of a is loaded before
+ * anything is stored and each column of b is read before the same column
+ * of the result is written so the result can alias either input.
+ */
+
+#if defined(MATRIX_AVX)
+
+void
+matrix_multiply(float *out, const float *a, const float *b)
+{
+   /* Each column of a repeated in both 128-bit lanes */
+   __m256 a0 = _mm256_broadcast_ps((const __m128 *) (a + 0));
+   __m256 a1 = _mm256_broadcast_ps((const __m128 *) (a + 4));
+   __m256 a2 = _mm256_broadcast_ps((const __m128 *) (a + 8));
+   __m256 a3 = _mm256_broadcast_ps((const __m128 *) (a + 12));
+   __m256 bv, r;
+   int j;
+
+   /* Two columns of the result at a time */
+   for (j = 0; j < 16; j += 8) {
+      bv = _mm256_loadu_ps(b + j);
+      r = _mm256_mul_ps(a0, _mm256_shuffle_ps(bv, bv, 0x00));
+      r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_shuffle_ps(bv, bv, 0x55)));
+      r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_shuffle_ps(bv, bv, 0xaa)));
+      r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_shuffle_ps(bv, bv, 0xff)));
+      _mm256_storeu_ps(out + j, r);
+   }
+}
+
+#elif defined(MATRIX_SSE2)
+
+void
+matrix_multiply(float *out, const float *a, const float *b)
+{
+   __m128 a0 = _mm_loadu_ps(a + 0);
+   __m128 a1 = _mm_loadu_ps(a + 4);
+   __m128 a2 = _mm_loadu_ps(a + 8);
+   __m128 a3 = _mm_loadu_ps(a + 12);
+   __m128 bv, r;
+   int j;
+
+   for (j = 0; j < 16; j += 4) {
+      bv = _mm_loadu_ps(b + j);
+      r = _mm_mul_ps(a0, _mm_shuffle_ps(bv, bv, 0x00));
+      r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_shuffle_ps(bv, bv, 0x55)));
+      r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_shuffle_ps(bv, bv, 0xaa)));
+      r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_shuffle_ps(bv, bv, 0xff)));
+      _mm_storeu_ps(out + j, r);
+   }
+}
+
+#elif defined(MATRIX_NEON)
+
+void
+matrix_multiply(float *out, const float *a, const float *b)
+{
+   float32x4_t a0 = vld1q_f32(a + 0);
+   float32x4_t a1 = vld1q_f32(a + 4);
+   float32x4_t a2 = vld1q_f32(a + 8);
+   float32x4_t a3 = vld1q_f32(a + 12);
+   float32x4_t bv, r;
+   int j;
+
+   for (j = 0; j < 16; j += 4) {
+      bv = vld1q_f32(b + j);
+      r = vmulq_lane_f32(a0, vget_low_f32(bv), 0);
+      r = vmlaq_lane_f32(r, a1, vget_low_f32(bv), 1);
+      r = vmlaq_lane_f32(r, a2, vget_high_f32(bv), 0);
+      r = vmlaq_lane_f32(r, a3, vget_high_f32(bv), 1);
+      vst1q_f32(out + j, r);
+   }
+}
+
+#else
+
+void
+matrix_multiply(float *out, const float *a, const float *b)
+{
+   float tmp[16];
+   int i, j;
+
+   for (j = 0; j < 16; j += 4) {
+      for (i = 0; i < 4; i++) {
+         tmp[j + i] = (a[i] * b[j] +
+                       a[4 + i] * b[j + 1] +
+                       a[8 + i] * b[j + 2] +
+                       a[12 + i] * b[j + 3]);
+      }
+   }
+
+   memcpy(out, tmp, sizeof tmp);
+}
+
+#endif
+
+/*
+ * The helpers below combine whole columns of a matrix. They are the only
+ * parts of the remaining functions that need vectorizing.
+ */
+
+#if defined(MATRIX_SSE2) || defined(MATRIX_AVX)
+
+/* out = p * x + q * y + r * z + s */
+static inline void
+combine_columns(float *out,
+                const float *p, float x,
+                const float *q, float y,
+                const float *r, float z,
+                const float *s)
+{
+   __m128 v = _mm_loadu_ps(s);
+
+   v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(p), _mm_set1_ps(x)));
+   v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(q), _mm_set1_ps(y)));
+   v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(r), _mm_set1_ps(z)));
+   _mm_storeu_ps(out, v);
+}
+
+/* Replaces columns p and q with p * c + q * s and q * c - p * s */
+static inline void
+rotate_columns(float *p, float *q, float c, float s)
+{
+   __m128 pv = _mm_loadu_ps(p);
+   __m128 qv = _mm_loadu_ps(q);
+   __m128 cv = _mm_set1_ps(c);
+   __m128 sv = _mm_set1_ps(s);
+
+   _mm_storeu_ps(p, _mm_add_ps(_mm_mul_ps(pv, cv), _mm_mul_ps(qv, sv)));
+   _mm_storeu_ps(q, _mm_sub_ps(_mm_mul_ps(qv, cv), _mm_mul_ps(pv, sv)));
+}
+
+#elif defined(MATRIX_NEON)
+
+static inline void
+combine_columns(float *out,
+                const float *p, float x,
+                const float *q, float y,
+                const float *r, float z,
+                const float *s)
+{
+   float32x4_t v = vld1q_f32(s);
+
+   v = vmlaq_n_f32(v, vld1q_f32(p), x);
+   v = vmlaq_n_f32(v, vld1q_f32(q), y);
+   v = vmlaq_n_f32(v, vld1q_f32(r), z);
+   vst1q_f32(out, v);
+}
+
+static inline void
+rotate_columns(float *p, float *q, float c, float s)
+{
+   float32x4_t pv = vld1q_f32(p);
+   float32x4_t qv = vld1q_f32(q);
+
+   vst1q_f32(p, vmlaq_n_f32(vmulq_n_f32(pv, c), qv, s));
+   vst1q_f32(q, vmlsq_n_f32(vmulq_n_f32(qv, c), pv, s));
+}
+
+#else
+
+static inline void
+combine_columns(float *out,
+                const float *p, float x,
+                const float *q, float y,
+                const float *r, float z,
+                const float *s)
+{
+   float tmp[4];
+   int i;
+
+   for (i = 0; i < 4; i++)
+      tmp[i] = p[i] * x + q[i] * y + r[i] * z + s[i];
+
+   memcpy(out, tmp, sizeof tmp);
+}
+
+static inline void
+rotate_columns(float *p, float *q, float c, float s)
+{
+   float tp;
+   int i;
+
+   for (i = 0; i < 4; i++) {
+      tp = p[i];
+      p[i] = tp * c + q[i] * s;
+      q[i] = q[i] * c - tp * s;
+   }
+}
+
+#endif
+
+void
+matrix_translate(float *m, float x, float y, float z)
+{
+   combine_columns(m + 12, m, x, m + 4, y, m + 8, z, m + 12);
+}
+
+void
+matrix_rotate(float *m, float angle, float x, float y, float z)
+{
+   static const float zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+   float s, c, t;
+   float col0[4], col1[4];
+
+   sincosf(angle, &s, &c);
+   t = 1.0f - c;
+
+   /* Only the first three columns are affected. The rotation matrix is
+    * applied one column at a time, keeping copies of the columns of m
+    * that are still needed. */
+   combine_columns(col0,
+                   m, x * x * t + c,
+                   m + 4, y * x * t + z * s,
+                   m + 8, x * z * t - y * s,
+                   zero);
+   combine_columns(col1,
+                   m, x * y * t - z * s,
+                   m + 4, y * y * t + c,
+                   m + 8, y * z * t + x * s,
+                   zero);
+   combine_columns(m + 8,
+                   m, x * z * t + y * s,
+                   m + 4, y * z * t - x * s,
+                   m + 8, z * z * t + c,
+                   zero);
+   memcpy(m, col0, sizeof col0);
+   memcpy(m + 4, col1, sizeof col1);
+}
+
+void
+matrix_scale(float *m, float x, float y, float z)
+{
+   static const float zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+   combine_columns(m, m, x, zero, 0.0f, zero, 0.0f, zero);
+   combine_columns(m + 4, m + 4, y, zero, 0.0f, zero, 0.0f, zero);
+   combine_columns(m + 8, m + 8, z, zero, 0.0f, zero, 0.0f, zero);
+}
+
+void
+matrix_translate_rotate_z(float *m, float x, float y, float angle)
+{
+   static const float zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+   float s, c;
+
+   sincosf(angle, &s, &c);
+
+   combine_columns(m + 12, m, x, m + 4, y, zero, 0.0f, m + 12);
+   rotate_columns(m, m + 4, c, s);
+}
+
+void
+matrix_normal(float *normal, const float *m)
+{
+   const float *a = m, *b = m + 4, *c = m + 8;
+   float det, scale;
+   int i;
+
+   /* The columns of the inverse transpose are the cross products of the
+    * other two columns divided by the determinant */
+   normal[0] = b[1] * c[2] - b[2] * c[1];
+   normal[1] = b[2] * c[0] - b[0] * c[2];
+   normal[2] = b[0] * c[1] - b[1] * c[0];
+   normal[3] = c[1] * a[2] - c[2] * a[1];
+   normal[4] = c[2] * a[0] - c[0] * a[2];
+   normal[5] = c[0] * a[1] - c[1] * a[0];
+   normal[6] = a[1] * b[2] - a[2] * b[1];
+   normal[7] = a[2] * b[0] - a[0] * b[2];
+   normal[8] = a[0] * b[1] - a[1] * b[0];
+
+   det = a[0] * normal[0] + a[1] * normal[1] + a[2] * normal[2];
+
+   /* A singular matrix has no inverse but the cofactors still give
+    * something usable for directions */
+   if (det == 0.0f)
+      return;
+
+   scale = 1.0f / det;
+   for (i = 0; i < 9; i++)
+      normal[i] *= scale;
+}
+
+void
+matrix_frustum(float *m,
+               float left, float right,
+               float bottom, float top,
+               float nearval, float farval)
+{
+   float x, y, a, b, c, d;
+
+   x = (2.0f * nearval) / (right - left);
+   y = (2.0f * nearval) / (top - bottom);
+   a = (right + left) / (right - left);
+   b = (top + bottom) / (top - bottom);
+   c = -(farval + nearval) / ( farval - nearval);
+   d = -(2.0f * farval * nearval) / (farval - nearval);
+
+#define M(row,col)  m[col*4+row]
+   M (0,0) = x;     M (0,1) = 0.0f;  M (0,2) = a;      M (0,3) = 0.0f;
+   M (1,0) = 0.0f;  M (1,1) = y;     M (1,2) = b;      M (1,3) = 0.0f;
+   M (2,0) = 0.0f;  M (2,1) = 0.0f;  M (2,2) = c;      M (2,3) = d;
+   M (3,0) = 0.0f;  M (3,1) = 0.0f;  M (3,2) = -1.0f;  M (3,3) = 0.0f;
+#undef M
+}
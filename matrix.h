@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 1999-2001  Brian Paul   All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * BRIAN PAUL BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+ * AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MATRIX_H
+#define MATRIX_H
+
+/*
+ * 4x4 matrices are stored in column-major order as in GL. All of the
+ * functions that modify a matrix post-multiply it like the fixed-function
+ * GL matrix stack did, ie, the new transformation is applied to vertices
+ * before the existing ones.
+ *
+ * The functions use SSE2 or AVX on x86 and NEON on ARM depending on what
+ * the compiler is allowed to target. Defining MATRIX_NO_SIMD selects the
+ * scalar reference implementation instead.
+ */
+
+/**
+ * Returns the name of the instruction set used by the matrix functions.
+ */
+const char *
+matrix_implementation(void);
+
+/**
+ * Creates an identity 4x4 matrix.
+ *
+ * @param m the matrix make an identity matrix
+ */
+void
+matrix_identity(float *m);
+
+/**
+ * Multiplies two 4x4 matrices.
+ *
+ * @param out filled with a * b. It may be the same as either a or b.
+ * @param a the first matrix to multiply
+ * @param b the second matrix to multiply
+ */
+void
+matrix_multiply(float *out, const float *a, const float *b);
+
+/**
+ * Translates a 4x4 matrix.
+ *
+ * @param[in,out] m the matrix to translate
+ * @param x the x component of the direction to translate to
+ * @param y the y component of the direction to translate to
+ * @param z the z component of the direction to translate to
+ */
+void
+matrix_translate(float *m, float x, float y, float z);
+
+/**
+ * Rotates a 4x4 matrix around an axis.
+ *
+ * @param[in,out] m the matrix to rotate
+ * @param angle the angle to rotate in radians
+ * @param x the x component of the unit axis to rotate around
+ * @param y the y component of the unit axis to rotate around
+ * @param z the z component of the unit axis to rotate around
+ */
+void
+matrix_rotate(float *m, float angle, float x, float y, float z);
+
+/**
+ * Scales a 4x4 matrix.
+ *
+ * @param[in,out] m the matrix to scale
+ * @param x the scale factor along the x axis
+ * @param y the scale factor along the y axis
+ * @param z the scale factor along the z axis
+ */
+void
+matrix_scale(float *m, float x, float y, float z);
+
+/**
+ * Translates a 4x4 matrix in the XY plane and then rotates it around the
+ * Z axis. This is the same as matrix_translate() followed by
+ * matrix_rotate() but only touches the columns that change.
+ *
+ * @param[in,out] m the matrix to transform
+ * @param x the x component of the translation
+ * @param y the y component of the translation
+ * @param angle the angle to rotate in radians
+ */
+void
+matrix_translate_rotate_z(float *m, float x, float y, float angle);
+
+/**
+ * Calculates the matrix to transform normals with, ie, the inverse
+ * transpose of the upper 3x3 part of a 4x4 matrix. Unlike simply
+ * transposing the rotation this stays correct if the matrix contains a
+ * scale.
+ *
+ * @param normal filled with the column-major 3x3 normal matrix
+ * @param m the 4x4 model view matrix
+ */
+void
+matrix_normal(float *normal, const float *m);
+
+/**
+ * Creates a perspective projection matrix like glFrustum.
+ */
+void
+matrix_frustum(float *m,
+               float left, float right,
+               float bottom, float top,
+               float nearval, float farval);
+
+#endif /* MATRIX_H */
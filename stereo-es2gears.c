@@ -53,21 +53,29 @@
 #include <fcntl.h>
 #include <gbm.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
-#include <sys/time.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <assert.h>
 
+#include "matrix.h"
+
 struct mode_layout {
    /* Total size of the buffer containing the combined images */
    uint32_t buffer_width, buffer_height;
@@ -81,6 +89,51 @@ struct mode_layout {
    uint32_t right_eye_x, left_eye_y;
 };
 
+/* Property IDs looked up once at startup for atomic commits */
+struct kms_props {
+   /* connector */
+   uint32_t conn_crtc_id;
+   /* crtc */
+   uint32_t crtc_mode_id, crtc_active;
+   /* crtc, only looked up for variable refresh */
+   uint32_t crtc_vrr_enabled;
+   /* primary plane */
+   uint32_t plane_fb_id, plane_crtc_id;
+   uint32_t plane_src_x, plane_src_y, plane_src_w, plane_src_h;
+   uint32_t plane_crtc_x, plane_crtc_y, plane_crtc_w, plane_crtc_h;
+};
+
+/* The time histograms have this many buckets for each power of two
+ * nanoseconds, which puts the percentiles within about 6% */
+#define TIME_SUB_BUCKET_BITS 3
+#define TIME_SUB_BUCKETS (1 << TIME_SUB_BUCKET_BITS)
+/* Times of 2^40 ns, about 18 minutes, and over go in the last bucket */
+#define TIME_BUCKETS ((40 - TIME_SUB_BUCKET_BITS + 1) * TIME_SUB_BUCKETS)
+
+/**
+ * Histogram of the times taken by something, such as a stage of a frame.
+ */
+struct time_histogram {
+   uint32_t buckets[TIME_BUCKETS];
+   uint64_t count, total_ns, max_ns;
+};
+
+/**
+ * When a frame was started and the vblank it was meant to be displayed
+ * on, both CLOCK_MONOTONIC nanoseconds. The target is 0 when there was
+ * no vblank to aim for.
+ */
+struct frame_times {
+   uint64_t latch_ns, target_ns;
+};
+
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
+/* Least time left spare before the vblank with late latching */
+#define MIN_LATCH_MARGIN_NS UINT64_C(500000)
+
 struct gbm_dev {
    int fd;
    struct mode_layout layout;
@@ -90,9 +143,77 @@ struct gbm_dev {
    uint32_t crtc;
    drmModeCrtc *saved_crtc;
 
+   /* Whether presentation goes through atomic commits. If this is false
+    * the legacy drmModeSetCrtc/drmModePageFlip API is used instead */
+   bool atomic;
+   uint32_t plane;
+   uint32_t mode_blob;
+   struct kms_props props;
+
    int pending_swap;
+
+   /* Framebuffer ioctl counters, to check that the cache works */
+   unsigned int n_add_fb, n_rm_fb, n_presents;
+   unsigned int reported_add_fb, reported_rm_fb, reported_presents;
+
+   /* Whether the page flip events are stamped with CLOCK_MONOTONIC */
+   bool monotonic_timestamps;
+   /* Duration of a refresh, from the mode and then measured from the
+    * page flips */
+   uint64_t refresh_ns;
+   /* When the pending flip was submitted */
+   uint64_t submit_ns;
+   /* The vblank sequence number and time of the last completed flip, if
+    * there has been one */
+   bool have_last_flip;
+   unsigned int last_flip_seq;
+   uint64_t last_flip_ns;
+   /* Flip statistics since the last report. A vblank counts as missed
+    * when it passes without a flip between two flips. */
+   unsigned int n_flips, missed_vblanks;
+   struct time_histogram flip_intervals, flip_latencies;
+
+   /* Whether frames are started as late as possible before the vblank
+    * that they are meant for, so that they show the latest state */
+   bool late_latch;
+   /* Moving average of the time from starting a frame to submitting
+    * it, and the time left spare on top of that, which grows when
+    * frames miss their vblank */
+   uint64_t frame_cost_ns, latch_margin_ns;
+   /* The times of the frame whose flip is pending */
+   struct frame_times queued_times;
+   /* Frames that missed their target vblank since the last report and
+    * the times from starting them to their scanout */
+   unsigned int missed_targets;
+   struct time_histogram latch_latencies;
+
+   /* Whether frames are presented as fast as they are rendered instead
+    * of once per vblank. Flips are asynchronous if the driver supports
+    * it for the API in use, and otherwise frames waiting for scanout
+    * are dropped when a newer one is ready. */
+   bool benchmark;
+   bool async_legacy_flips, async_atomic_flips;
+   /* Frames dropped without being presented since the last report */
+   unsigned int n_dropped;
+
+   /* Whether the display refreshes when a frame is ready, as long as
+    * it is within its range. refresh_ns is then the shortest refresh
+    * and is left at that. */
+   bool vrr;
 };
 
+/* KMS framebuffer for a gbm_bo. This is attached to the buffer as user
+ * data so that it is only created the first time GBM hands the buffer
+ * out and is removed when the surface destroys the buffer */
+struct drm_fb {
+   struct gbm_dev *dev;
+   uint32_t fb_id;
+   uint32_t width, height;
+   uint32_t stride, handle;
+};
+
+#define MAX_FRAMES_IN_FLIGHT 3
+
 struct gbm_context {
    struct gbm_dev *dev;
    struct gbm_device *gbm;
@@ -102,29 +223,121 @@ struct gbm_context {
    EGLSurface egl_surface;
    EGLContext egl_context;
 
-   uint32_t current_fb_id;
+   /* Buffer currently being scanned out */
    struct gbm_bo *current_bo;
+   /* Buffer whose flip has been submitted but hasn't completed yet */
+   struct gbm_bo *queued_bo;
+   /* Rendered buffers waiting for the queued flip to complete, oldest
+    * first, and the times of their frames */
+   struct gbm_bo *ready_bos[MAX_FRAMES_IN_FLIGHT];
+   struct frame_times ready_times[MAX_FRAMES_IN_FLIGHT];
+   int n_ready_bos;
+   /* Maximum number of rendered frames that may wait for scanout */
+   int frames_in_flight;
 };
 
 struct stereo_options {
    const char *card;
    const char *stereo_layout;
    uint32_t connector;
+   bool legacy_kms;
+   int frames_in_flight;
+   /* Render offscreen without a display, emulating a mode of this size */
+   bool headless;
+   uint32_t headless_width, headless_height;
+   /* Exit after this many frames if it is not zero */
+   unsigned int max_frames;
+   /* Draw both eyes in one pass with instancing */
+   bool single_pass_stereo;
+   /* Store the gear vertices as floats instead of the compact format */
+   bool float_vertices;
+   /* Number of gears to lay out, or 0 for the classic three gears */
+   int n_gears;
+   /* Range of tooth counts for the laid out gears */
+   int min_teeth, max_teeth;
+   /* Draw every gear with its own draw call instead of batching them */
+   bool per_gear_draws;
+   /* Move the camera closer than needed to see the whole scene */
+   float zoom;
+   /* Draw all of the gears at full detail regardless of their size */
+   bool full_detail;
+   /* Number of threads to build the gear meshes on */
+   int threads;
+   /* Always build the gear meshes instead of loading them from disk */
+   bool no_mesh_cache;
+   /* Start each frame as late as possible before its vblank */
+   bool late_latch;
+   /* Present frames as fast as they are rendered, not once per vblank */
+   bool benchmark;
+   /* Use variable refresh if the display supports it */
+   bool vrr;
+};
+
+/* Offscreen rendering target used when there is no display */
+struct headless_context {
+   EGLDisplay edpy;
+   EGLConfig egl_config;
+   EGLContext egl_context;
+   GLuint fbo, color_rb, depth_rb;
+
+   PFNEGLCREATESYNCKHRPROC create_sync;
+   PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+   PFNEGLCLIENTWAITSYNCKHRPROC client_wait_sync;
+   /* Fences for the frames that the GPU may still be rendering, oldest
+    * first */
+   EGLSyncKHR fences[MAX_FRAMES_IN_FLIGHT];
+   int n_fences;
+   int frames_in_flight;
+
+   /* Whether the first frame has been submitted. That starts the clock
+    * so that building the scene isn't counted, and n_frames counts the
+    * frames after it */
+   bool started;
+   unsigned int n_frames, reported_frames;
+   struct timespec start_time, report_time;
 };
 
 struct stereo_winsys {
    int fd;
    struct gbm_dev *dev;
    struct gbm_context *context;
+   struct headless_context *headless;
+   struct mode_layout layout;
 };
 
 struct stereo_renderer {
    struct mode_layout layout;
 };
 
+struct event_source;
+
+typedef void (*event_source_func)(struct event_source *source,
+                                  uint32_t events);
+
+/* A file descriptor watched by the event loop */
+struct event_source {
+   int fd;
+   event_source_func func;
+   void *data;
+};
+
+struct event_loop {
+   int epoll_fd;
+};
+
 struct stereo_data {
    struct stereo_winsys *winsys;
    struct stereo_renderer *renderer;
+
+   struct event_loop loop;
+   struct event_source drm_source;
+   struct event_source signal_source;
+   struct event_source stats_source;
+   struct event_source latch_source;
+   /* Signals that are read from the signalfd */
+   sigset_t signals;
+   bool quit;
+   unsigned int max_frames;
 };
 
 struct stereo_mode {
@@ -150,7 +363,13 @@ stereo_modes[] = {
 #define VERTICES_PER_TOOTH 34
 #define GEAR_VERTEX_STRIDE 6
 
+/* Size of the FIFO post-transform vertex cache that meshes are optimized
+ * for and that the ACMR statistics are measured with */
+#define VERTEX_CACHE_SIZE 16
+
 #define UNUSED(x) (void)(x)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 /**
  * Struct describing the vertices in triangle strip
@@ -165,36 +384,385 @@ struct vertex_strip {
 /* Each vertex consist of GEAR_VERTEX_STRIDE GLfloat attributes */
 typedef GLfloat GearVertex[GEAR_VERTEX_STRIDE];
 
+/**
+ * How the vertices of the gears are stored in their vertex buffers.
+ */
+enum vertex_format {
+   /** GearVertex as it is generated, 24 bytes */
+   VERTEX_FORMAT_FLOAT,
+   /** Normalized short positions and normalized byte normals, 12 bytes */
+   VERTEX_FORMAT_SHORT_BYTE,
+   /** Normalized short positions and 10_10_10_2 normals, 12 bytes */
+   VERTEX_FORMAT_SHORT_PACKED,
+};
+
+/**
+ * A vertex in one of the compact formats. The positions are divided by
+ * the gear's scale so that they fit in [-1, 1].
+ */
+struct packed_vertex {
+   /* The fourth component is only there for alignment */
+   GLshort position[4];
+   union {
+      GLbyte bytes[4];
+      GLuint packed;
+   } normal;
+};
+
+#ifndef GL_INT_2_10_10_10_REV
+#define GL_INT_2_10_10_10_REV 0x8D9F
+#endif
+#ifndef GL_INT_10_10_10_2_OES
+#define GL_INT_10_10_10_2_OES 0x8DF7
+#endif
+
+/**
+ * The levels of detail that each gear mesh is made in.
+ */
+enum gear_lod {
+   /** The full teeth */
+   GEAR_LOD_FULL,
+   /** Pointed teeth without the top and bottom lands */
+   GEAR_LOD_SIMPLE,
+   /** A cylinder at the pitch circle */
+   GEAR_LOD_CYLINDER,
+   N_GEAR_LODS,
+};
+
+/* Most sides of the GEAR_LOD_CYLINDER meshes */
+#define CYLINDER_SEGMENTS 16
+
+/* Vertices and strips that each tooth is made of at each level of
+ * detail, or each side of the cylinder */
+static const int tooth_vertices[N_GEAR_LODS] = { VERTICES_PER_TOOTH, 22, 16 };
+static const int tooth_strips[N_GEAR_LODS] = { STRIPS_PER_TOOTH, 5, 4 };
+
 /**
  * Struct representing a gear.
  */
 struct gear {
-   /** The array of vertices comprising the gear */
+   /** The array of vertices comprising the gear while it is being
+    * built */
    GearVertex *vertices;
+   /** The vertices converted to vertex_format, ready to upload. They
+    * are in the scene's geometry arena or the mapped cache file and
+    * are gone once the gear is uploaded. */
+   const void *vertex_data;
    /** The number of vertices comprising the gear */
    int nvertices;
-   /** The array of triangle strips comprising the gear */
-   struct vertex_strip *strips;
-   /** The number of triangle strips comprising the gear */
-   int nstrips;
+   /** The list of GL_TRIANGLES indices comprising the gear, which is
+    * gone once the gear is uploaded like vertex_data */
+   GLushort *indices;
+   /** The number of indices */
+   int nindices;
    /** The Vertex Buffer Object holding the vertices in the
     * graphics card */
    GLuint vbo;
+   /** The buffer object holding the indices */
+   GLuint ibo;
+   /** The scale to apply to the positions in the vertex buffer */
+   GLfloat scale;
+   /** Radius of the sphere around the origin that contains the gear */
+   GLfloat bounding_radius;
+   /** The number of copies of the gear in the buffers for
+    * DRAW_MODE_BATCHED, otherwise 1 */
+   int batch_size;
+   /** Buffer holding the copy number of each vertex for
+    * DRAW_MODE_BATCHED */
+   GLuint batch_vbo;
+   /** Where the instances drawn with the gear start in the instance
+    * buffer, for DRAW_MODE_INSTANCED and DRAW_MODE_BATCHED */
+   int first_instance;
+   /** The Vertex Array Object with the attributes set up, or 0 if
+    * vertex array objects aren't supported */
+   GLuint vao;
+   /** The vertex count and ACMR before and after the mesh was
+    * optimized, for the report. Not known for cached meshes. */
+   int unoptimized_nvertices;
+   float unoptimized_acmr, acmr;
 };
 
 /** The view rotation [x, y, z] */
 static GLfloat view_rot[3] = { 50.0, 30.0, 0.0 };
 
-/** The gears */
-static struct gear *gear1, *gear2, *gear3;
-/** The current gear rotation angle */
-static GLfloat angle = 0.0;
-/** The location of the shader uniforms */
-static GLuint ModelViewProjectionMatrix_location,
-   NormalMatrix_location, LightSourcePosition_location,
-   MaterialColor_location;
-/** The projection matrix */
-static GLfloat ProjectionMatrix[16];
+/**
+ * The parameters that a gear mesh is created from.
+ */
+struct gear_params {
+   GLfloat inner_radius;
+   GLfloat outer_radius;
+   GLfloat width;
+   GLint teeth;
+   GLfloat tooth_depth;
+};
+
+/**
+ * A gear mesh shared by all of the gears with the same parameters.
+ */
+struct gear_mesh {
+   struct gear_params params;
+   /** The mesh at each level of detail */
+   struct gear *lods[N_GEAR_LODS];
+   /** The gears using the mesh, which are consecutive in the scene */
+   int first_gear, n_gears;
+   /** The number of those gears drawn at each level of detail this
+    * frame, for DRAW_MODE_INSTANCED and DRAW_MODE_BATCHED */
+   int n_visible[N_GEAR_LODS];
+   /** The root of the bounding volume hierarchy over the gears */
+   int bvh_root;
+   /** The mapped cache file that the gears were loaded from, which is
+    * unmapped once they are uploaded */
+   void *cache_map;
+   size_t cache_size;
+};
+
+/* Most gears in a leaf of the bounding volume hierarchy */
+#define BVH_LEAF_SIZE 8
+
+/**
+ * A node of a bounding volume hierarchy over the gears of a mesh. The
+ * gears of the mesh are ordered so that every node covers a consecutive
+ * range of them. The nodes are stored depth first, so the first child
+ * of a node comes right after it.
+ */
+struct bvh_node {
+   /** Bounding sphere of the gears, which are centered on z = 0 */
+   GLfloat x, y, radius;
+   int first_gear, n_gears;
+   /** Index of the second child, or 0 for leaves */
+   int right;
+};
+
+/* Alignment of everything allocated from an arena */
+#define ARENA_ALIGN 16
+/* Smallest block that an arena allocates */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct arena_block {
+   struct arena_block *next;
+   size_t size, used;
+};
+
+/* Where the data of a block starts after its header */
+#define ARENA_BLOCK_DATA \
+   ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/**
+ * Allocates data that is all freed at the same time. The data is packed
+ * into a few large blocks, so it is contiguous and the allocations cost
+ * next to nothing. Allocating is thread safe.
+ */
+struct arena {
+   struct arena_block *blocks;
+   /** Bytes handed out and bytes taken by the blocks */
+   size_t used, reserved;
+   int n_blocks;
+   pthread_mutex_t mutex;
+};
+
+/**
+ * The gears to draw. The data of each gear is stored as a structure of
+ * arrays indexed by the gear number, with the gears sorted by mesh.
+ */
+struct scene {
+   struct gear_mesh *meshes;
+   int n_meshes, meshes_size;
+
+   int n_gears, gears_size;
+   /** Position of the center of each gear */
+   GLfloat *x, *y;
+   /** Rotation of each gear in degrees when the angle is 0 */
+   GLfloat *phase;
+   /** Rotation of each gear relative to the angle. This is negative for
+    * gears turning the other way. */
+   GLfloat *ratio;
+   GLfloat (*color)[4];
+   /** Index of the mesh of each gear in meshes */
+   int *mesh;
+
+   /** The nodes of the hierarchies of all of the meshes */
+   struct bvh_node *nodes;
+   int n_nodes;
+
+   /** Distance from the origin to the furthest tooth tip */
+   GLfloat radius;
+
+   /** Everything that lives as long as the scene */
+   struct arena arena;
+   /** The vertices and indices of the gears until they are uploaded */
+   struct arena geometry;
+};
+
+static struct scene scene;
+/** The current gear rotation angle. It isn't wrapped because the gears
+ * turn at different ratios. */
+static double angle = 0.0;
+/** Distance from the camera to the center of the scene */
+static GLfloat view_distance = 20.0;
+/** Depth range of the projection */
+static GLfloat near_plane = 1.0, far_plane = 1024.0;
+/** How much closer the camera is than needed to see the whole scene */
+static GLfloat view_zoom = 1.0;
+
+/*
+ * The planes used to cull the gears, in view space. A point p is on the
+ * inside of a plane if dot(plane.xyz, p) + plane.w >= 0.
+ */
+/** The planes around the frusta of both eyes together */
+static GLfloat cull_planes[6][4];
+/** The left and right planes of the frustum of each eye */
+static GLfloat eye_cull_planes[2][2][4];
+/**
+ * A range of gears in the scene which the same eyes can see.
+ */
+struct visible_range {
+   int first_gear, n_gears;
+   /** Bit mask of the eyes */
+   unsigned int eyes;
+};
+
+/** The gears that survived culling in the current frame, in scene
+ * order */
+static struct visible_range *visible_ranges;
+static int n_visible_ranges;
+/** Gears that culling kept from being drawn for each eye and time spent
+ * culling since the last FPS report */
+static unsigned int culled_gears[2];
+static double cull_time;
+
+/* Projected radius in pixels below which a gear is drawn at the next
+ * coarser level of detail */
+static const GLfloat lod_radius[N_GEAR_LODS - 1] = { 40.0f, 10.0f };
+/* How far past the threshold the radius has to go before the level of
+ * detail changes, as a fraction of the threshold. This stops gears near
+ * a threshold from switching back and forth. */
+#define LOD_HYSTERESIS 0.15f
+
+/** Whether to pick the level of detail of the gears from their size */
+static bool lod_enabled = true;
+/** The level of detail of each gear for each eye. This is kept between
+ * frames for the hysteresis. */
+static uint8_t (*gear_lods)[2];
+/** Pixels per unit at a distance of 1 from each eye, along the axis
+ * with fewer pixels */
+static GLfloat lod_scale[2];
+
+#define MAX_CACHED_UNIFORMS 8
+
+/** The last value uploaded to a uniform of a program */
+struct cached_uniform {
+   GLint location;
+   GLsizei size;
+   GLfloat value[32];
+};
+
+/**
+ * A shader program for drawing the gears and the location of its
+ * uniforms.
+ */
+struct gear_program {
+   GLuint program;
+   /** ModelViewProjectionMatrix, or ModelMatrix for single-pass stereo */
+   GLint matrix_location;
+   GLint normal_matrix_location;
+   GLint light_location;
+   GLint color_location;
+   /** Per-eye view-projection matrices and clip-space remapping, only
+    * used for single-pass stereo */
+   GLint eye_view_projection_location;
+   GLint eye_remap_location;
+   /** Scale of the mesh positions, for the instanced programs */
+   GLint scale_location;
+   /** Uniform arrays of the gears in a batch for DRAW_MODE_BATCHED */
+   GLint instance_transform_location;
+   GLint instance_color_location;
+   /** Uniform values as last uploaded, to skip redundant uploads */
+   struct cached_uniform uniforms[MAX_CACHED_UNIFORMS];
+   int n_uniforms;
+};
+
+/**
+ * Shadow copy of the GL state changed by the draw path, so that calls
+ * which wouldn't change anything can be skipped.
+ */
+struct gl_state {
+   const struct gear_program *program;
+   GLuint vertex_array;
+   GLuint array_buffer;
+   GLuint element_array_buffer;
+   /** The gear that the attribute pointers point into without VAOs */
+   const struct gear *attrib_gear;
+   /** The gear that the instance attributes point at without VAOs */
+   const struct gear *instance_gear;
+   uint32_t enabled_attribs;
+   GLint viewport[4];
+   /** Calls made and calls skipped since the last FPS report */
+   unsigned int calls, skipped_calls;
+};
+
+/* Value for bindings whose current state is unknown */
+#define UNKNOWN_BINDING (~(GLuint) 0)
+
+static struct gl_state gl_state;
+
+/** The program drawing one eye at a time */
+static struct gear_program two_pass_program;
+/** The program drawing both eyes with one instance each */
+static struct gear_program single_pass_program;
+/** Whether both eyes are drawn in a single pass */
+static bool single_pass_stereo;
+/** Buffer holding the eye index of each instance for single-pass stereo */
+static GLuint eye_vbo;
+/** Instanced drawing entry points, from ES 3 or an extension */
+static PFNGLDRAWELEMENTSINSTANCEDEXTPROC DrawElementsInstanced;
+static PFNGLVERTEXATTRIBDIVISOREXTPROC VertexAttribDivisor;
+/**
+ * How the gears are submitted to GL.
+ */
+enum draw_mode {
+   /** One draw call per gear and eye with its matrices in uniforms */
+   DRAW_MODE_PER_GEAR,
+   /** One instanced draw call per mesh and eye with the gears in an
+    * instance buffer */
+   DRAW_MODE_INSTANCED,
+   /** The meshes are repeated in their buffers so that a batch of gears
+    * can be drawn at once with their transforms in uniform arrays */
+   DRAW_MODE_BATCHED,
+};
+
+/* Upper limit on the copies of each mesh for DRAW_MODE_BATCHED, to
+ * bound the memory used by the copies */
+#define MAX_BATCH_SIZE 16
+
+static enum draw_mode draw_mode;
+/** Number of gears drawn at once with DRAW_MODE_BATCHED */
+static int batch_size = 1;
+/** The transform of each gear for the current frame as the x and y
+ * position and the cosine and sine of the angle, and its color. The
+ * visible gears of each mesh are packed at the start of its range of
+ * the scene. */
+static GLfloat (*instance_transforms)[4];
+static GLfloat (*instance_colors)[4];
+/** Buffer with the instance transforms followed by the colors */
+static GLuint instance_vbo;
+/** The format of the vertices in the gear vertex buffers */
+static enum vertex_format vertex_format;
+/** The type of the normals for VERTEX_FORMAT_SHORT_PACKED */
+static GLenum packed_normal_type;
+/** Vertex array object entry points, from ES 3 or an extension */
+static PFNGLGENVERTEXARRAYSOESPROC GenVertexArrays;
+static PFNGLBINDVERTEXARRAYOESPROC BindVertexArray;
+static PFNGLDELETEVERTEXARRAYSOESPROC DeleteVertexArrays;
+/** Draw calls and CPU time spent in redraw() since the last FPS report.
+ * The time is the same as recorded for STAGE_REDRAW. */
+static unsigned int draw_calls;
+static uint64_t redraw_ns;
+/** Triangles drawn since the last FPS report */
+static unsigned long drawn_triangles;
+/** The projection times the view matrix of each eye */
+static GLfloat EyeViewProjectionMatrix[2][16];
+/** The viewport of each eye */
+static GLint EyeViewport[2][4];
 /** The direction of the directional light for the scene */
 static const GLfloat LightSourcePosition[4] = { 5.0, 5.0, 10.0, 1.0 };
 
@@ -202,8 +770,6 @@ static GLfloat eyesep = 0.5;            /* Eye separation. */
 static GLfloat fix_point = 40.0;        /* Fixation point distance.  */
 static GLfloat left, right, asp;        /* Stereo frustum params.  */
 
-static int quit = 0;
-
 static void *
 xmalloc(size_t size)
 {
@@ -215,6 +781,273 @@ xmalloc(size_t size)
    abort();
 }
 
+static void
+arena_init(struct arena *arena)
+{
+   memset(arena, 0, sizeof *arena);
+   pthread_mutex_init(&arena->mutex, NULL);
+}
+
+/**
+ * Allocates memory from an arena, aborting if there is no memory left
+ * like xmalloc().
+ */
+static void *
+arena_alloc(struct arena *arena, size_t size)
+{
+   struct arena_block *block;
+   void *res;
+
+   size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+   pthread_mutex_lock(&arena->mutex);
+
+   block = arena->blocks;
+
+   if (block == NULL || block->size - block->used < size) {
+      block = xmalloc(ARENA_BLOCK_DATA + MAX(size, ARENA_BLOCK_SIZE));
+      block->size = MAX(size, ARENA_BLOCK_SIZE);
+      block->used = 0;
+
+      /* Keep filling the current block if the new one is only for this
+       * allocation */
+      if (arena->blocks && size >= ARENA_BLOCK_SIZE) {
+         block->next = arena->blocks->next;
+         arena->blocks->next = block;
+      } else {
+         block->next = arena->blocks;
+         arena->blocks = block;
+      }
+
+      arena->reserved += ARENA_BLOCK_DATA + block->size;
+      arena->n_blocks++;
+   }
+
+   res = (char *) block + ARENA_BLOCK_DATA + block->used;
+   block->used += size;
+   arena->used += size;
+
+   pthread_mutex_unlock(&arena->mutex);
+
+   return res;
+}
+
+static void *
+arena_dup(struct arena *arena, const void *data, size_t size)
+{
+   return memcpy(arena_alloc(arena, size), data, size);
+}
+
+/**
+ * Frees everything allocated from an arena, which can then be used
+ * again.
+ */
+static void
+arena_free(struct arena *arena)
+{
+   struct arena_block *block, *next;
+
+   for (block = arena->blocks; block; block = next) {
+      next = block->next;
+      free(block);
+   }
+
+   arena->blocks = NULL;
+   arena->used = 0;
+   arena->reserved = 0;
+   arena->n_blocks = 0;
+}
+
+/**
+ * Frees everything allocated from an arena and the arena itself, which
+ * can't be used again without arena_init().
+ */
+static void
+arena_fini(struct arena *arena)
+{
+   arena_free(arena);
+   pthread_mutex_destroy(&arena->mutex);
+}
+
+/**
+ * The stages of a frame that are timed. The cull stage is part of the
+ * redraw. The eyes can't be timed separately because every gear is drawn
+ * for both eyes before moving on to the next one.
+ */
+enum frame_stage {
+   STAGE_IDLE,
+   STAGE_REDRAW,
+   STAGE_CULL,
+   STAGE_SWAP_BUFFERS,
+   STAGE_LOCK_FRONT_BUFFER,
+   STAGE_ADD_FB,
+   STAGE_PAGE_FLIP,
+   STAGE_WAIT_FLIP,
+   STAGE_WAIT_LATCH,
+   N_FRAME_STAGES,
+};
+
+static const char *const frame_stage_names[N_FRAME_STAGES] = {
+   "gears_idle",
+   "redraw",
+   "  cull",
+   "eglSwapBuffers",
+   "lock front buffer",
+   "drmModeAddFB",
+   "page flip",
+   "wait for flip",
+   "wait for latch",
+};
+
+/* The stage times since the last report and since the start */
+static struct time_histogram stage_times[N_FRAME_STAGES];
+static struct time_histogram total_stage_times[N_FRAME_STAGES];
+
+static uint64_t
+get_time_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/**
+ * Gets the bucket of a time. Below TIME_SUB_BUCKETS ns every time has a
+ * bucket of its own, above that each power of two is split into
+ * TIME_SUB_BUCKETS buckets.
+ */
+static int
+get_time_bucket(uint64_t ns)
+{
+   int bits, bucket;
+
+   if (ns < TIME_SUB_BUCKETS)
+      return ns;
+
+   bits = 63 - __builtin_clzll(ns);
+   bucket = ((bits - TIME_SUB_BUCKET_BITS + 1) * TIME_SUB_BUCKETS +
+             ((ns >> (bits - TIME_SUB_BUCKET_BITS)) &
+              (TIME_SUB_BUCKETS - 1)));
+
+   return MIN(bucket, TIME_BUCKETS - 1);
+}
+
+/**
+ * Gets the middle of the range of times in a bucket, in nanoseconds.
+ */
+static double
+get_time_bucket_time(int bucket)
+{
+   int bits, sub;
+
+   if (bucket < TIME_SUB_BUCKETS)
+      return bucket;
+
+   bits = bucket / TIME_SUB_BUCKETS + TIME_SUB_BUCKET_BITS - 1;
+   sub = bucket % TIME_SUB_BUCKETS;
+
+   return ldexp(TIME_SUB_BUCKETS + sub + 0.5,
+                bits - TIME_SUB_BUCKET_BITS);
+}
+
+static void
+record_time(struct time_histogram *hist, uint64_t ns)
+{
+   hist->buckets[get_time_bucket(ns)]++;
+   hist->count++;
+   hist->total_ns += ns;
+   hist->max_ns = MAX(hist->max_ns, ns);
+}
+
+static void
+record_stage(enum frame_stage stage, uint64_t ns)
+{
+   record_time(stage_times + stage, ns);
+   record_time(total_stage_times + stage, ns);
+}
+
+/**
+ * Records the time taken by a stage.
+ *
+ * @param start the get_time_ns() when the stage started
+ */
+static void
+end_stage(enum frame_stage stage, uint64_t start)
+{
+   record_stage(stage, get_time_ns() - start);
+}
+
+/**
+ * Gets a percentile of the times in a histogram in nanoseconds. It is
+ * never more than the maximum, which is known exactly.
+ */
+static double
+get_time_percentile(const struct time_histogram *hist, double percentile)
+{
+   uint64_t rank = ceil(hist->count * percentile / 100.0), seen = 0;
+   int i;
+
+   for (i = 0; i < TIME_BUCKETS; i++) {
+      seen += hist->buckets[i];
+      if (seen >= rank)
+         return fmin(get_time_bucket_time(i), hist->max_ns);
+   }
+
+   return hist->max_ns;
+}
+
+static void
+print_time_header(void)
+{
+   printf("  %-18s %8s %8s %8s %8s %8s %8s\n",
+          "(us)", "mean", "p50", "p95", "p99", "max", "count");
+}
+
+/**
+ * Prints the mean, percentiles and maximum of a histogram in a row under
+ * print_time_header().
+ */
+static void
+print_time_row(const char *name, const struct time_histogram *hist)
+{
+   printf("  %-18s %8.1f %8.1f %8.1f %8.1f %8.1f %8llu\n",
+          name,
+          hist->total_ns / 1e3 / hist->count,
+          get_time_percentile(hist, 50.0) / 1e3,
+          get_time_percentile(hist, 95.0) / 1e3,
+          get_time_percentile(hist, 99.0) / 1e3,
+          hist->max_ns / 1e3,
+          (unsigned long long) hist->count);
+}
+
+/**
+ * Prints the percentiles of the time taken by each stage that ran.
+ *
+ * @param hists the histograms of the stages
+ * @param period what the times cover
+ */
+static void
+report_stage_times(const struct time_histogram *hists, const char *period)
+{
+   bool header = false;
+   int i;
+
+   for (i = 0; i < N_FRAME_STAGES; i++) {
+      if (hists[i].count == 0)
+         continue;
+
+      if (!header) {
+         printf("stage times %s:\n", period);
+         print_time_header();
+         header = true;
+      }
+
+      print_time_row(frame_stage_names[i], hists + i);
+   }
+}
+
 static int
 stereo_find_crtc(drmModeRes *res, drmModeConnector *conn,
                  struct gbm_dev *dev)
@@ -433,6 +1266,14 @@ stereo_setup_dev(drmModeRes *res, drmModeConnector *conn,
 
    mode_3d = dev->mode.flags & DRM_MODE_FLAG_3D_MASK;
 
+   /* The clock is in kHz */
+   if (dev->mode.clock > 0) {
+      dev->refresh_ns = ((uint64_t) dev->mode.htotal * dev->mode.vtotal *
+                         1000000 / dev->mode.clock);
+   } else if (dev->mode.vrefresh > 0) {
+      dev->refresh_ns = 1000000000 / dev->mode.vrefresh;
+   }
+
    fprintf(stderr, "mode for connector %u is %ux%u (%s)\n",
            conn->connector_id,
            dev->layout.eye_width, dev->layout.eye_height,
@@ -453,40 +1294,282 @@ stereo_setup_dev(drmModeRes *res, drmModeConnector *conn,
    return 0;
 }
 
+struct prop_lookup {
+   const char *name;
+   uint32_t *id;
+};
+
 static int
-stereo_open(int *out, const struct stereo_options *options)
+lookup_props(int fd, uint32_t object_id, uint32_t object_type,
+             const struct prop_lookup *lookups, int n_lookups)
 {
-   const char *card = options->card;
-   int fd, ret;
+   drmModeObjectProperties *props;
+   drmModePropertyRes *prop;
+   uint32_t i;
+   int j, ret = 0;
 
-   if (card == NULL)
-      card = "/dev/dri/card0";
+   props = drmModeObjectGetProperties(fd, object_id, object_type);
+   if (props == NULL)
+      return -errno;
 
-   fd = open(card, O_RDWR | O_CLOEXEC);
-   if (fd < 0) {
-      ret = -errno;
-      fprintf(stderr, "cannot open '%s': %m\n", card);
-      return ret;
+   for (j = 0; j < n_lookups; j++)
+      *lookups[j].id = 0;
+
+   for (i = 0; i < props->count_props; i++) {
+      prop = drmModeGetProperty(fd, props->props[i]);
+      if (prop == NULL)
+         continue;
+
+      for (j = 0; j < n_lookups; j++) {
+         if (!strcmp(prop->name, lookups[j].name))
+            *lookups[j].id = prop->prop_id;
+      }
+
+      drmModeFreeProperty(prop);
    }
 
-   if (drmSetClientCap(fd, DRM_CLIENT_CAP_STEREO_3D, 1)) {
-      fprintf(stderr, "error setting stereo client cap: %m\n");
-      close(fd);
-      return -errno;
+   drmModeFreeObjectProperties(props);
+
+   for (j = 0; j < n_lookups; j++) {
+      if (*lookups[j].id == 0) {
+         fprintf(stderr, "KMS object %u has no \"%s\" property\n",
+                 object_id, lookups[j].name);
+         ret = -ENOENT;
+      }
    }
 
-   *out = fd;
-   return 0;
+   return ret;
 }
 
-static drmModeConnector *
-get_connector(int fd, drmModeRes *res,
-              const struct stereo_options *options)
+/**
+ * Gets the current value of a property of a KMS object.
+ *
+ * @return whether the object has the property
+ */
+static bool
+get_prop_value(int fd, uint32_t object_id, uint32_t object_type,
+               const char *name, uint64_t *value)
 {
-   drmModeConnector *conn;
-   int i;
+   drmModeObjectProperties *props;
+   drmModePropertyRes *prop;
+   bool ret = false;
+   uint32_t i;
 
-   for (i = 0; i < res->count_connectors; i++) {
+   props = drmModeObjectGetProperties(fd, object_id, object_type);
+   if (props == NULL)
+      return false;
+
+   for (i = 0; i < props->count_props && !ret; i++) {
+      prop = drmModeGetProperty(fd, props->props[i]);
+      if (prop == NULL)
+         continue;
+
+      if (!strcmp(prop->name, name)) {
+         *value = props->prop_values[i];
+         ret = true;
+      }
+
+      drmModeFreeProperty(prop);
+   }
+
+   drmModeFreeObjectProperties(props);
+
+   return ret;
+}
+
+static bool
+is_primary_plane(int fd, uint32_t plane_id)
+{
+   uint64_t type;
+
+   return (get_prop_value(fd, plane_id, DRM_MODE_OBJECT_PLANE,
+                          "type", &type) &&
+           type == DRM_PLANE_TYPE_PRIMARY);
+}
+
+static int
+find_primary_plane(struct gbm_dev *dev, drmModeRes *res)
+{
+   drmModePlaneRes *planes;
+   drmModePlane *plane;
+   int crtc_index = -1;
+   uint32_t i;
+   int ret = -ENOENT;
+
+   for (i = 0; i < (uint32_t) res->count_crtcs; i++) {
+      if (res->crtcs[i] == dev->crtc)
+         crtc_index = i;
+   }
+   if (crtc_index == -1)
+      return -ENOENT;
+
+   planes = drmModeGetPlaneResources(dev->fd);
+   if (planes == NULL)
+      return -errno;
+
+   for (i = 0; i < planes->count_planes && ret; i++) {
+      plane = drmModeGetPlane(dev->fd, planes->planes[i]);
+      if (plane == NULL)
+         continue;
+
+      if ((plane->possible_crtcs & (1 << crtc_index)) &&
+          is_primary_plane(dev->fd, plane->plane_id)) {
+         dev->plane = plane->plane_id;
+         ret = 0;
+      }
+
+      drmModeFreePlane(plane);
+   }
+
+   drmModeFreePlaneResources(planes);
+
+   return ret;
+}
+
+/* Tries to switch the device over to atomic modesetting. On any failure
+ * dev->atomic is left false so that the legacy API is used instead */
+static void
+stereo_setup_atomic(struct gbm_dev *dev, drmModeRes *res)
+{
+   struct kms_props *p = &dev->props;
+   const struct prop_lookup conn_props[] = {
+      { "CRTC_ID", &p->conn_crtc_id },
+   };
+   const struct prop_lookup crtc_props[] = {
+      { "MODE_ID", &p->crtc_mode_id },
+      { "ACTIVE", &p->crtc_active },
+   };
+   const struct prop_lookup plane_props[] = {
+      { "FB_ID", &p->plane_fb_id },
+      { "CRTC_ID", &p->plane_crtc_id },
+      { "SRC_X", &p->plane_src_x },
+      { "SRC_Y", &p->plane_src_y },
+      { "SRC_W", &p->plane_src_w },
+      { "SRC_H", &p->plane_src_h },
+      { "CRTC_X", &p->plane_crtc_x },
+      { "CRTC_Y", &p->plane_crtc_y },
+      { "CRTC_W", &p->plane_crtc_w },
+      { "CRTC_H", &p->plane_crtc_h },
+   };
+
+   dev->atomic = false;
+
+   if (drmSetClientCap(dev->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+      fprintf(stderr, "atomic modesetting not supported (%m), "
+              "using legacy KMS API\n");
+      return;
+   }
+
+   if (find_primary_plane(dev, res)) {
+      fprintf(stderr, "no primary plane found for crtc %u, "
+              "using legacy KMS API\n", dev->crtc);
+      return;
+   }
+
+#define N_LOOKUPS(x) ((int) (sizeof (x) / sizeof (x)[0]))
+   if (lookup_props(dev->fd, dev->conn, DRM_MODE_OBJECT_CONNECTOR,
+                    conn_props, N_LOOKUPS(conn_props)) ||
+       lookup_props(dev->fd, dev->crtc, DRM_MODE_OBJECT_CRTC,
+                    crtc_props, N_LOOKUPS(crtc_props)) ||
+       lookup_props(dev->fd, dev->plane, DRM_MODE_OBJECT_PLANE,
+                    plane_props, N_LOOKUPS(plane_props))) {
+      fprintf(stderr, "missing KMS properties, using legacy KMS API\n");
+      return;
+   }
+#undef N_LOOKUPS
+
+   if (drmModeCreatePropertyBlob(dev->fd, &dev->mode, sizeof dev->mode,
+                                 &dev->mode_blob)) {
+      fprintf(stderr, "failed to create mode blob (%m), "
+              "using legacy KMS API\n");
+      return;
+   }
+
+   fprintf(stderr, "using atomic modesetting on plane %u\n", dev->plane);
+
+   dev->atomic = true;
+}
+
+/**
+ * Turns on variable refresh if the display and the driver support it.
+ * It's enabled on the CRTC with the atomic modeset, so it needs atomic
+ * modesetting.
+ */
+static void
+setup_vrr(struct gbm_dev *dev)
+{
+   struct kms_props *p = &dev->props;
+   const struct prop_lookup crtc_props[] = {
+      { "VRR_ENABLED", &p->crtc_vrr_enabled },
+   };
+   uint64_t capable;
+
+   if (!dev->atomic) {
+      fprintf(stderr, "WARNING: variable refresh needs atomic "
+              "modesetting\n");
+      return;
+   }
+
+   if (!get_prop_value(dev->fd, dev->conn, DRM_MODE_OBJECT_CONNECTOR,
+                       "vrr_capable", &capable) || !capable) {
+      fprintf(stderr, "WARNING: connector %u isn't capable of "
+              "variable refresh\n", dev->conn);
+      return;
+   }
+
+   if (lookup_props(dev->fd, dev->crtc, DRM_MODE_OBJECT_CRTC,
+                    crtc_props, 1)) {
+      fprintf(stderr, "WARNING: crtc %u can't enable variable refresh\n",
+              dev->crtc);
+      return;
+   }
+
+   fprintf(stderr, "using variable refresh up to %.1f Hz\n",
+           1e9 / dev->refresh_ns);
+
+   dev->vrr = true;
+
+   if (dev->late_latch) {
+      fprintf(stderr, "WARNING: late latching doesn't work "
+              "with variable refresh\n");
+      dev->late_latch = false;
+   }
+}
+
+static int
+stereo_open(int *out, const struct stereo_options *options)
+{
+   const char *card = options->card;
+   int fd, ret;
+
+   if (card == NULL)
+      card = "/dev/dri/card0";
+
+   fd = open(card, O_RDWR | O_CLOEXEC);
+   if (fd < 0) {
+      ret = -errno;
+      fprintf(stderr, "cannot open '%s': %m\n", card);
+      return ret;
+   }
+
+   if (drmSetClientCap(fd, DRM_CLIENT_CAP_STEREO_3D, 1)) {
+      fprintf(stderr, "error setting stereo client cap: %m\n");
+      close(fd);
+      return -errno;
+   }
+
+   *out = fd;
+   return 0;
+}
+
+static drmModeConnector *
+get_connector(int fd, drmModeRes *res,
+              const struct stereo_options *options)
+{
+   drmModeConnector *conn;
+   int i;
+
+   for (i = 0; i < res->count_connectors; i++) {
       conn = drmModeGetConnector(fd, res->connectors[i]);
 
       if (conn == NULL) {
@@ -510,12 +1593,44 @@ get_connector(int fd, drmModeRes *res,
    return NULL;
 }
 
+/**
+ * Sets up presenting frames as fast as they are rendered. Atomic
+ * modesetting can still fall back to the legacy API on the first
+ * commit, so support for async flips is checked for both.
+ */
+static void
+setup_benchmark(struct gbm_dev *dev)
+{
+   uint64_t cap;
+
+   dev->benchmark = true;
+
+   if (drmGetCap(dev->fd, DRM_CAP_ASYNC_PAGE_FLIP, &cap) == 0 && cap)
+      dev->async_legacy_flips = true;
+   if (drmGetCap(dev->fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap) == 0 &&
+       cap)
+      dev->async_atomic_flips = true;
+
+   fprintf(stderr, "benchmark mode: %s\n",
+           (dev->atomic ? dev->async_atomic_flips :
+            dev->async_legacy_flips) ?
+           "async page flips" :
+           "async page flips not supported, dropping frames");
+
+   if (dev->late_latch) {
+      fprintf(stderr, "WARNING: late latching doesn't work "
+              "in benchmark mode\n");
+      dev->late_latch = false;
+   }
+}
+
 static struct gbm_dev *
 stereo_prepare_dev(int fd, const struct stereo_options *options)
 {
    drmModeRes *res;
    drmModeConnector *conn;
    struct gbm_dev *dev;
+   uint64_t cap;
    int ret;
 
    /* retrieve resources */
@@ -536,6 +1651,16 @@ stereo_prepare_dev(int fd, const struct stereo_options *options)
    dev->conn = conn->connector_id;
    dev->fd = fd;
 
+   if (drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) == 0 && cap)
+      dev->monotonic_timestamps = true;
+
+   dev->late_latch = options->late_latch;
+   dev->latch_margin_ns = 4 * MIN_LATCH_MARGIN_NS;
+
+   if (dev->late_latch && !dev->monotonic_timestamps)
+      fprintf(stderr, "WARNING: the page flip timestamps aren't "
+              "monotonic, late latching is disabled\n");
+
    /* call helper function to prepare this connector */
    ret = stereo_setup_dev(res, conn, options, dev);
    if (ret) {
@@ -549,6 +1674,19 @@ stereo_prepare_dev(int fd, const struct stereo_options *options)
       goto error_dev;
    }
 
+   if (!options->legacy_kms)
+      stereo_setup_atomic(dev, res);
+
+   if (options->benchmark) {
+      setup_benchmark(dev);
+      if (options->vrr) {
+         fprintf(stderr, "WARNING: variable refresh doesn't work "
+                 "in benchmark mode\n");
+      }
+   } else if (options->vrr) {
+      setup_vrr(dev);
+   }
+
    drmModeFreeConnector(conn);
    drmModeFreeResources(res);
 
@@ -563,9 +1701,28 @@ error:
    return NULL;
 }
 
+/* Turns variable refresh back off, which the legacy drmModeSetCrtc()
+ * used to restore the CRTC wouldn't do */
+static void
+disable_vrr(struct gbm_dev *dev)
+{
+   drmModeAtomicReq *req = drmModeAtomicAlloc();
+
+   drmModeAtomicAddProperty(req, dev->crtc, dev->props.crtc_vrr_enabled, 0);
+   if (drmModeAtomicCommit(dev->fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET,
+                           NULL))
+      fprintf(stderr, "Failed to disable variable refresh: %m\n");
+   drmModeAtomicFree(req);
+
+   dev->vrr = false;
+}
+
 static void
 restore_saved_crtc(struct gbm_dev *dev)
 {
+   if (dev->vrr && dev->saved_crtc)
+      disable_vrr(dev);
+
    /* restore saved CRTC configuration */
    if (dev->saved_crtc) {
       drmModeSetCrtc(dev->fd,
@@ -587,6 +1744,9 @@ stereo_cleanup_dev(struct gbm_dev *dev)
 {
    restore_saved_crtc(dev);
 
+   if (dev->mode_blob)
+      drmModeDestroyPropertyBlob(dev->fd, dev->mode_blob);
+
    /* free allocated memory */
    free(dev);
 }
@@ -594,10 +1754,6 @@ stereo_cleanup_dev(struct gbm_dev *dev)
 static void
 free_current_bo(struct gbm_context *context)
 {
-   if (context->current_fb_id) {
-      drmModeRmFB(context->dev->fd, context->current_fb_id);
-      context->current_fb_id = 0;
-   }
    if (context->current_bo) {
       gbm_surface_release_buffer(context->gbm_surface,
                                  context->current_bo);
@@ -690,12 +1846,15 @@ create_egl_context(struct gbm_context *context)
 }
 
 static struct gbm_context *
-stereo_prepare_context(struct gbm_dev *dev)
+stereo_prepare_context(struct gbm_dev *dev,
+                       const struct stereo_options *options)
 {
    struct gbm_context *context;
 
    context = xmalloc(sizeof(*context));
+   memset(context, 0, sizeof(*context));
    context->dev = dev;
+   context->frames_in_flight = options->frames_in_flight;
 
    context->gbm = gbm_create_device(dev->fd);
    if (context->gbm == NULL) {
@@ -765,9 +1924,61 @@ stereo_cleanup_context(struct gbm_context *context)
    gbm_surface_destroy(context->gbm_surface);
    eglTerminate(context->edpy);
    gbm_device_destroy(context->gbm);
+
+   fprintf(stderr, "framebuffers: %u added, %u removed over %u presents\n",
+           context->dev->n_add_fb, context->dev->n_rm_fb,
+           context->dev->n_presents);
+
    free(context);
 }
 
+/**
+ * Folds a refresh duration measured between two flips into the one used
+ * to predict when frames are displayed. The clock of the display is
+ * never quite the nominal one, and the prediction drifts off without
+ * this. Measurements far from the current value are ignored because
+ * they come from a stall or a mode change.
+ */
+static void
+update_refresh(struct gbm_dev *dev, uint64_t refresh_ns)
+{
+   if (dev->refresh_ns == 0) {
+      dev->refresh_ns = refresh_ns;
+      return;
+   }
+
+   if (refresh_ns * 10 < dev->refresh_ns * 9 ||
+       refresh_ns * 10 > dev->refresh_ns * 11)
+      return;
+
+   /* Moving average over about 16 flips */
+   dev->refresh_ns = (dev->refresh_ns * 15 + refresh_ns) / 16;
+}
+
+/**
+ * Checks whether the frame that was just flipped made it to the vblank
+ * that it was meant for. Late latching leaves more time spare after a
+ * miss and slowly takes it back while frames keep making it.
+ */
+static void
+check_frame_target(struct gbm_dev *dev, uint64_t flip_ns)
+{
+   const struct frame_times *times = &dev->queued_times;
+
+   if (flip_ns > times->latch_ns)
+      record_time(&dev->latch_latencies, flip_ns - times->latch_ns);
+
+   if (flip_ns > times->target_ns + dev->refresh_ns / 2) {
+      dev->missed_targets++;
+      dev->latch_margin_ns = MIN(dev->latch_margin_ns * 2,
+                                 dev->refresh_ns / 2);
+   } else {
+      dev->latch_margin_ns -= dev->latch_margin_ns / 32;
+   }
+
+   dev->latch_margin_ns = MAX(dev->latch_margin_ns, MIN_LATCH_MARGIN_NS);
+}
+
 static void
 page_flip_handler(int fd,
                   unsigned int frame,
@@ -776,26 +1987,56 @@ page_flip_handler(int fd,
                   void *data)
 {
    UNUSED(fd);
-   UNUSED(frame);
-   UNUSED(sec);
-   UNUSED(usec);
 
    struct gbm_dev *dev = data;
+   uint64_t flip_ns = sec * UINT64_C(1000000000) + usec * UINT64_C(1000);
 
    dev->pending_swap = 0;
+   dev->n_flips++;
+
+   /* The time is the end of the vblank that the flip landed on, when
+    * the new frame starts being scanned out. The latency only makes
+    * sense if it's on our clock */
+   if (dev->monotonic_timestamps && flip_ns > dev->submit_ns)
+      record_time(&dev->flip_latencies, flip_ns - dev->submit_ns);
+
+   if (dev->have_last_flip && frame != dev->last_flip_seq) {
+      dev->missed_vblanks += frame - dev->last_flip_seq - 1;
+      record_time(&dev->flip_intervals, flip_ns - dev->last_flip_ns);
+      if (!dev->vrr) {
+         update_refresh(dev, (flip_ns - dev->last_flip_ns) /
+                        (frame - dev->last_flip_seq));
+      }
+   }
+
+   dev->have_last_flip = true;
+   dev->last_flip_seq = frame;
+   dev->last_flip_ns = flip_ns;
+
+   if (dev->monotonic_timestamps && dev->queued_times.target_ns != 0)
+      check_frame_target(dev, flip_ns);
 }
 
 static void
 wait_swap(struct gbm_dev *dev)
 {
+   struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+   uint64_t start, wait_ns = 0;
    drmEventContext evctx;
 
    while (dev->pending_swap) {
+      /* Only the wait for the event counts, not handling it */
+      start = get_time_ns();
+      poll(&pfd, 1, -1);
+      wait_ns += get_time_ns() - start;
+
       memset(&evctx, 0, sizeof(evctx));
       evctx.version = DRM_EVENT_CONTEXT_VERSION;
       evctx.page_flip_handler = page_flip_handler;
       drmHandleEvent(dev->fd, &evctx);
    }
+
+   record_stage(STAGE_WAIT_FLIP, wait_ns);
 }
 
 static int
@@ -817,827 +2058,4952 @@ set_initial_crtc(struct gbm_dev *dev, uint32_t fb_id)
 }
 
 static void
-swap(struct stereo_winsys *winsys)
+add_plane_props(drmModeAtomicReq *req, struct gbm_dev *dev, uint32_t fb_id)
 {
-   struct gbm_dev *dev = winsys->dev;
-   struct gbm_context *context = winsys->context;
-   struct gbm_bo *bo;
-   uint32_t handle, stride;
-   uint32_t width, height;
-   uint32_t fb_id;
-
-   eglSwapBuffers(context->edpy, context->egl_surface);
-
-   bo = gbm_surface_lock_front_buffer(context->gbm_surface);
-   width = gbm_bo_get_width(bo);
-   height = gbm_bo_get_height(bo);
-   stride = gbm_bo_get_stride(bo);
-   handle = gbm_bo_get_handle(bo).u32;
+   const struct kms_props *p = &dev->props;
+   uint32_t width = dev->layout.buffer_width;
+   uint32_t height = dev->layout.buffer_height;
+
+   drmModeAtomicAddProperty(req, dev->plane, p->plane_fb_id, fb_id);
+   drmModeAtomicAddProperty(req, dev->plane, p->plane_crtc_id, dev->crtc);
+   /* The source rectangle is in 16.16 fixed point */
+   drmModeAtomicAddProperty(req, dev->plane, p->plane_src_x, 0);
+   drmModeAtomicAddProperty(req, dev->plane, p->plane_src_y, 0);
+   drmModeAtomicAddProperty(req, dev->plane, p->plane_src_w, width << 16);
+   drmModeAtomicAddProperty(req, dev->plane, p->plane_src_h, height << 16);
+   drmModeAtomicAddProperty(req, dev->plane, p->plane_crtc_x, 0);
+   drmModeAtomicAddProperty(req, dev->plane, p->plane_crtc_y, 0);
+   drmModeAtomicAddProperty(req, dev->plane, p->plane_crtc_w, width);
+   drmModeAtomicAddProperty(req, dev->plane, p->plane_crtc_h, height);
+}
 
-   if (drmModeAddFB(dev->fd,
-                    width, height,
-                    24, /* depth */
-                    32, /* bpp */
-                    stride,
-                    handle,
-                    &fb_id)) {
-      fprintf(stderr,
-              "Failed to create new back buffer handle: %m\n");
-   } else {
-      if (dev->saved_crtc == NULL &&
-          set_initial_crtc(dev, fb_id))
-         return;
+static int
+atomic_modeset(struct gbm_dev *dev, uint32_t fb_id)
+{
+   const struct kms_props *p = &dev->props;
+   drmModeAtomicReq *req;
+   int ret;
 
-      if (drmModePageFlip(dev->fd,
-                          dev->crtc,
-                          fb_id,
-                          DRM_MODE_PAGE_FLIP_EVENT,
-                          dev)) {
-         fprintf(stderr, "Failed to page flip: %m\n");
-         return;
-      }
+   req = drmModeAtomicAlloc();
+
+   drmModeAtomicAddProperty(req, dev->conn, p->conn_crtc_id, dev->crtc);
+   drmModeAtomicAddProperty(req, dev->crtc, p->crtc_mode_id, dev->mode_blob);
+   drmModeAtomicAddProperty(req, dev->crtc, p->crtc_active, 1);
+   if (dev->vrr)
+      drmModeAtomicAddProperty(req, dev->crtc, p->crtc_vrr_enabled, 1);
+   add_plane_props(req, dev, fb_id);
+
+   /* Validate the whole configuration before touching the hardware so
+    * that we can still fall back to the legacy API if the driver
+    * doesn't like it */
+   ret = drmModeAtomicCommit(dev->fd, req,
+                             DRM_MODE_ATOMIC_TEST_ONLY |
+                             DRM_MODE_ATOMIC_ALLOW_MODESET,
+                             NULL);
+   if (ret && dev->vrr) {
+      fprintf(stderr, "atomic mode test with variable refresh failed "
+              "(%m), using a fixed refresh\n");
+      drmModeAtomicFree(req);
+      dev->vrr = false;
+      return atomic_modeset(dev, fb_id);
+   }
+   if (ret) {
+      fprintf(stderr, "atomic mode test failed (%m), "
+              "falling back to legacy KMS API\n");
+      drmModeAtomicFree(req);
+      return -EINVAL;
+   }
 
-      dev->pending_swap = 1;
+   ret = drmModeAtomicCommit(dev->fd, req,
+                             DRM_MODE_ATOMIC_ALLOW_MODESET |
+                             DRM_MODE_ATOMIC_NONBLOCK |
+                             DRM_MODE_PAGE_FLIP_EVENT,
+                             dev);
+   if (ret)
+      fprintf(stderr, "Failed to set drm mode: %m\n");
 
-      wait_swap(dev);
+   drmModeAtomicFree(req);
 
-      free_current_bo(context);
-      context->current_bo = bo;
-      context->current_fb_id = fb_id;
-   }
+   return ret;
 }
 
-static void
-winsys_disconnect(struct stereo_winsys *winsys)
+static int
+atomic_flip(struct gbm_dev *dev, uint32_t fb_id)
 {
-   if (winsys->context) {
-      stereo_cleanup_context(winsys->context);
-      winsys->context = NULL;
-   }
-   if (winsys->dev) {
-      stereo_cleanup_dev(winsys->dev);
-      winsys->dev = NULL;
-   }
-   if (winsys->fd != -1) {
-      close(winsys->fd);
-      winsys->fd = -1;
+   drmModeAtomicReq *req;
+   int ret;
+
+   req = drmModeAtomicAlloc();
+
+   /* Everything else is already part of the committed state */
+   drmModeAtomicAddProperty(req, dev->plane, dev->props.plane_fb_id, fb_id);
+
+   if (dev->async_atomic_flips) {
+      ret = drmModeAtomicCommit(dev->fd, req,
+                                DRM_MODE_ATOMIC_NONBLOCK |
+                                DRM_MODE_PAGE_FLIP_EVENT |
+                                DRM_MODE_PAGE_FLIP_ASYNC,
+                                dev);
+      if (ret == 0)
+         goto out;
+
+      /* Some drivers only take async flips in some configurations */
+      fprintf(stderr, "async atomic flip failed (%m), "
+              "dropping frames instead\n");
+      dev->async_atomic_flips = false;
    }
+
+   ret = drmModeAtomicCommit(dev->fd, req,
+                             DRM_MODE_ATOMIC_NONBLOCK |
+                             DRM_MODE_PAGE_FLIP_EVENT,
+                             dev);
+   if (ret)
+      fprintf(stderr, "Failed to commit flip: %m\n");
+
+out:
+
+   drmModeAtomicFree(req);
+
+   return ret;
 }
 
 static int
-winsys_connect(struct stereo_winsys *winsys,
-               const struct stereo_options *options)
+present_fb(struct gbm_dev *dev, uint32_t fb_id)
 {
-   int ret;
+   if (dev->saved_crtc == NULL && dev->atomic) {
+      dev->saved_crtc = drmModeGetCrtc(dev->fd, dev->crtc);
 
-   /* open the DRM device */
-   ret = stereo_open(&winsys->fd, options);
-   if (ret)
-      goto error;
+      switch (atomic_modeset(dev, fb_id)) {
+      case 0:
+         return 0;
+      case -EINVAL:
+         /* let set_initial_crtc() save the CRTC again */
+         drmModeFreeCrtc(dev->saved_crtc);
+         dev->saved_crtc = NULL;
+         dev->atomic = false;
+         dev->vrr = false;
+         break;
+      default:
+         return -1;
+      }
+   }
 
-   /* prepare all connectors and CRTCs */
-   winsys->dev = stereo_prepare_dev(winsys->fd, options);
-   if (winsys->dev == NULL) {
-      ret = -ENOENT;
-      goto error;
+   if (dev->atomic)
+      return atomic_flip(dev, fb_id);
+
+   if (dev->saved_crtc == NULL &&
+       set_initial_crtc(dev, fb_id))
+      return -1;
+
+   if (dev->async_legacy_flips) {
+      if (drmModePageFlip(dev->fd,
+                          dev->crtc,
+                          fb_id,
+                          DRM_MODE_PAGE_FLIP_EVENT |
+                          DRM_MODE_PAGE_FLIP_ASYNC,
+                          dev) == 0)
+         return 0;
+
+      fprintf(stderr, "async page flip failed (%m), "
+              "dropping frames instead\n");
+      dev->async_legacy_flips = false;
    }
 
-   winsys->context = stereo_prepare_context(winsys->dev);
-   if (winsys->context == NULL) {
-      ret = -ENOENT;
-      goto error;
+   if (drmModePageFlip(dev->fd,
+                       dev->crtc,
+                       fb_id,
+                       DRM_MODE_PAGE_FLIP_EVENT,
+                       dev)) {
+      fprintf(stderr, "Failed to page flip: %m\n");
+      return -1;
    }
 
    return 0;
-
-error:
-   winsys_disconnect(winsys);
-   return ret;
 }
 
 static void
-winsys_free(struct stereo_winsys *winsys)
+destroy_fb(struct gbm_bo *bo, void *data)
 {
-   winsys_disconnect(winsys);
-   free(winsys);
+   struct drm_fb *fb = data;
+
+   UNUSED(bo);
+
+   drmModeRmFB(fb->dev->fd, fb->fb_id);
+   fb->dev->n_rm_fb++;
+
+   free(fb);
 }
 
-static struct stereo_winsys *
-create_winsys(const struct stereo_options *options)
+static struct drm_fb *
+get_fb_for_bo(struct gbm_dev *dev, struct gbm_bo *bo)
 {
-   struct stereo_winsys *winsys = xmalloc(sizeof *winsys);
+   struct drm_fb *fb = gbm_bo_get_user_data(bo);
+   uint64_t start;
 
-   memset(winsys, 0, sizeof *winsys);
+   if (fb)
+      return fb;
 
-   winsys->fd = -1;
+   fb = xmalloc(sizeof *fb);
+   fb->dev = dev;
+   fb->width = gbm_bo_get_width(bo);
+   fb->height = gbm_bo_get_height(bo);
+   fb->stride = gbm_bo_get_stride(bo);
+   fb->handle = gbm_bo_get_handle(bo).u32;
 
-   if (winsys_connect(winsys, options) != 0) {
-      winsys_free(winsys);
+   start = get_time_ns();
+
+   if (drmModeAddFB(dev->fd,
+                    fb->width, fb->height,
+                    24, /* depth */
+                    32, /* bpp */
+                    fb->stride,
+                    fb->handle,
+                    &fb->fb_id)) {
+      fprintf(stderr,
+              "Failed to create new back buffer handle: %m\n");
+      free(fb);
       return NULL;
    }
 
-   return winsys;
+   end_stage(STAGE_ADD_FB, start);
+
+   dev->n_add_fb++;
+
+   gbm_bo_set_user_data(bo, fb, destroy_fb);
+
+   return fb;
+}
+
+/* Submits the oldest ready buffer for scanout if no flip is pending */
+static void
+queue_next_bo(struct gbm_context *context)
+{
+   struct gbm_dev *dev = context->dev;
+   struct gbm_bo *bo;
+   struct drm_fb *fb;
+   uint64_t start;
+   int ret;
+
+   /* Rather than waiting for the pending flip, the frames that are
+    * still waiting for it are replaced by the newest one */
+   if (dev->benchmark && context->queued_bo) {
+      while (context->n_ready_bos > 1) {
+         gbm_surface_release_buffer(context->gbm_surface,
+                                    context->ready_bos[0]);
+         context->n_ready_bos--;
+         memmove(context->ready_bos, context->ready_bos + 1,
+                 context->n_ready_bos * sizeof context->ready_bos[0]);
+         memmove(context->ready_times, context->ready_times + 1,
+                 context->n_ready_bos * sizeof context->ready_times[0]);
+         dev->n_dropped++;
+      }
+   }
+
+   while (context->queued_bo == NULL && context->n_ready_bos > 0) {
+      bo = context->ready_bos[0];
+      dev->queued_times = context->ready_times[0];
+      context->n_ready_bos--;
+      memmove(context->ready_bos, context->ready_bos + 1,
+              context->n_ready_bos * sizeof context->ready_bos[0]);
+      memmove(context->ready_times, context->ready_times + 1,
+              context->n_ready_bos * sizeof context->ready_times[0]);
+
+      fb = get_fb_for_bo(dev, bo);
+      if (fb == NULL) {
+         gbm_surface_release_buffer(context->gbm_surface, bo);
+         continue;
+      }
+
+      start = get_time_ns();
+      ret = present_fb(dev, fb->fb_id);
+      end_stage(STAGE_PAGE_FLIP, start);
+
+      dev->submit_ns = start;
+
+      if (ret) {
+         gbm_surface_release_buffer(context->gbm_surface, bo);
+         continue;
+      }
+
+      dev->pending_swap = 1;
+      dev->n_presents++;
+      context->queued_bo = bo;
+   }
+}
+
+/* Called once the queued flip has completed to queue the next one */
+static void
+queued_bo_done(struct gbm_context *context)
+{
+   free_current_bo(context);
+   context->current_bo = context->queued_bo;
+   context->queued_bo = NULL;
+
+   queue_next_bo(context);
+}
+
+/* Blocks until the queued flip completes */
+static void
+wait_queued_bo(struct gbm_context *context)
+{
+   wait_swap(context->dev);
+   queued_bo_done(context);
+}
+
+static int
+get_frames_in_flight(const struct gbm_context *context)
+{
+   return context->n_ready_bos + (context->queued_bo ? 1 : 0);
+}
+
+static bool
+has_extension(const char *extensions, const char *name)
+{
+   size_t len = strlen(name);
+   const char *p = extensions;
+
+   while (p && (p = strstr(p, name))) {
+      if ((p == extensions || p[-1] == ' ') &&
+          (p[len] == ' ' || p[len] == '\0'))
+         return true;
+      p += len;
+   }
+
+   return false;
+}
+
+static double
+timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+   return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/* Fills in a fake mode so that get_layout_for_mode() can be used for
+ * the emulated display */
+static int
+make_headless_mode(drmModeModeInfo *mode,
+                   const struct stereo_options *options)
+{
+   const char *layout_name = options->stereo_layout;
+   unsigned int i;
+
+   if (layout_name == NULL)
+      layout_name = "sbsh";
+
+   memset(mode, 0, sizeof *mode);
+
+   for (i = 0; i < sizeof stereo_modes / sizeof stereo_modes[0]; i++) {
+      if (!strcmp(stereo_modes[i].short_name, layout_name))
+         mode->flags = stereo_modes[i].mode_number;
+   }
+
+   if (get_mode_rank(mode) == -1 ||
+       (mode->flags == DRM_MODE_FLAG_3D_NONE && strcmp(layout_name, "none"))) {
+      fprintf(stderr, "unsupported stereo layout \"%s\"\n", layout_name);
+      return -EINVAL;
+   }
+
+   /* Use CEA-like timings so that frame packing gets its usual gap of
+    * vblank lines between the two eyes */
+   mode->hdisplay = options->headless_width;
+   mode->vdisplay = options->headless_height;
+   mode->htotal = mode->hdisplay + mode->hdisplay / 7;
+   mode->vtotal = mode->vdisplay + mode->vdisplay / 24;
+   mode->vrefresh = 60;
+   mode->clock = (uint32_t) mode->htotal * mode->vtotal * 60 / 1000;
+
+   return 0;
+}
+
+static int
+headless_create_fbo(struct headless_context *headless,
+                    const struct mode_layout *layout)
+{
+   const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+   GLenum color_format = GL_RGB565;
+   GLint max_size;
+
+   glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &max_size);
+   if (layout->buffer_width > (GLuint) max_size ||
+       layout->buffer_height > (GLuint) max_size) {
+      fprintf(stderr, "%ux%u buffer exceeds the maximum renderbuffer "
+              "size of %i\n",
+              layout->buffer_width, layout->buffer_height, max_size);
+      return -EINVAL;
+   }
+
+   if (has_extension(extensions, "GL_OES_rgb8_rgba8"))
+      color_format = GL_RGBA8_OES;
+
+   glGenRenderbuffers(1, &headless->color_rb);
+   glBindRenderbuffer(GL_RENDERBUFFER, headless->color_rb);
+   glRenderbufferStorage(GL_RENDERBUFFER, color_format,
+                         layout->buffer_width, layout->buffer_height);
+
+   glGenRenderbuffers(1, &headless->depth_rb);
+   glBindRenderbuffer(GL_RENDERBUFFER, headless->depth_rb);
+   glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16,
+                         layout->buffer_width, layout->buffer_height);
+
+   glGenFramebuffers(1, &headless->fbo);
+   glBindFramebuffer(GL_FRAMEBUFFER, headless->fbo);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                             GL_RENDERBUFFER, headless->color_rb);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                             GL_RENDERBUFFER, headless->depth_rb);
+
+   if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+       GL_FRAMEBUFFER_COMPLETE) {
+      fprintf(stderr, "offscreen framebuffer is incomplete\n");
+      return -EINVAL;
+   }
+
+   /* The framebuffer stays bound for the lifetime of the context */
+   return 0;
+}
+
+static void
+headless_cleanup(struct headless_context *headless)
+{
+   while (headless->n_fences > 0)
+      headless->destroy_sync(headless->edpy,
+                             headless->fences[--headless->n_fences]);
+
+   if (headless->fbo) {
+      glDeleteFramebuffers(1, &headless->fbo);
+      glDeleteRenderbuffers(1, &headless->color_rb);
+      glDeleteRenderbuffers(1, &headless->depth_rb);
+   }
+
+   if (headless->n_frames > 0) {
+      struct timespec now;
+      double seconds;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      seconds = timespec_diff(&now, &headless->start_time);
+      printf("headless: %u frames in %.3f seconds = %.3f frames/s\n",
+             headless->n_frames, seconds, headless->n_frames / seconds);
+   }
+
+   if (headless->edpy != EGL_NO_DISPLAY) {
+      eglMakeCurrent(headless->edpy,
+                     EGL_NO_SURFACE,
+                     EGL_NO_SURFACE,
+                     EGL_NO_CONTEXT);
+      if (headless->egl_context != EGL_NO_CONTEXT)
+         eglDestroyContext(headless->edpy, headless->egl_context);
+      eglTerminate(headless->edpy);
+   }
+
+   free(headless);
+}
+
+static struct headless_context *
+headless_prepare_context(const struct mode_layout *layout,
+                         const struct stereo_options *options)
+{
+   static const EGLint config_attribs[] = {
+      EGL_RED_SIZE, 1,
+      EGL_GREEN_SIZE, 1,
+      EGL_BLUE_SIZE, 1,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+      /* Nothing is rendered to an EGL surface */
+      EGL_SURFACE_TYPE, 0,
+      EGL_NONE
+   };
+   static const EGLint context_attribs[] = {
+      EGL_CONTEXT_CLIENT_VERSION, 2,
+      EGL_NONE
+   };
+   PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+   struct headless_context *headless;
+   const char *extensions;
+   EGLint config_count;
+
+   headless = xmalloc(sizeof *headless);
+   memset(headless, 0, sizeof *headless);
+   headless->edpy = EGL_NO_DISPLAY;
+   headless->egl_context = EGL_NO_CONTEXT;
+   headless->frames_in_flight = options->frames_in_flight;
+
+   extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+   get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+      eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+   if (!has_extension(extensions, "EGL_MESA_platform_surfaceless") ||
+       get_platform_display == NULL) {
+      fprintf(stderr, "EGL_MESA_platform_surfaceless is not supported\n");
+      goto error;
+   }
+
+   headless->edpy = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                         EGL_DEFAULT_DISPLAY,
+                                         NULL);
+   if (headless->edpy == EGL_NO_DISPLAY) {
+      fprintf(stderr, "error getting surfaceless EGL display\n");
+      goto error;
+   }
+
+   if (!eglInitialize(headless->edpy, NULL, NULL)) {
+      fprintf(stderr, "error intializing EGL display\n");
+      eglTerminate(headless->edpy);
+      headless->edpy = EGL_NO_DISPLAY;
+      goto error;
+   }
+
+   extensions = eglQueryString(headless->edpy, EGL_EXTENSIONS);
+   if (!has_extension(extensions, "EGL_KHR_surfaceless_context")) {
+      fprintf(stderr, "EGL_KHR_surfaceless_context is not supported\n");
+      goto error;
+   }
+
+   if (!eglChooseConfig(headless->edpy, config_attribs,
+                        &headless->egl_config, 1, &config_count) ||
+       config_count < 1) {
+      fprintf(stderr, "Unable to find a usable EGL configuration\n");
+      goto error;
+   }
+
+   headless->egl_context = eglCreateContext(headless->edpy,
+                                            headless->egl_config,
+                                            EGL_NO_CONTEXT,
+                                            context_attribs);
+   if (headless->egl_context == EGL_NO_CONTEXT) {
+      fprintf(stderr, "Error creating EGL context\n");
+      goto error;
+   }
+
+   if (!eglMakeCurrent(headless->edpy,
+                       EGL_NO_SURFACE,
+                       EGL_NO_SURFACE,
+                       headless->egl_context)) {
+      fprintf(stderr, "failed to make EGL context current\n");
+      goto error;
+   }
+
+   /* Without fences every frame is finished with glFinish instead */
+   if (has_extension(extensions, "EGL_KHR_fence_sync")) {
+      headless->create_sync = (PFNEGLCREATESYNCKHRPROC)
+         eglGetProcAddress("eglCreateSyncKHR");
+      headless->destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)
+         eglGetProcAddress("eglDestroySyncKHR");
+      headless->client_wait_sync = (PFNEGLCLIENTWAITSYNCKHRPROC)
+         eglGetProcAddress("eglClientWaitSyncKHR");
+   }
+
+   if (headless_create_fbo(headless, layout))
+      goto error;
+
+   fprintf(stderr, "rendering offscreen to a %ux%u buffer (%s)\n",
+           layout->buffer_width, layout->buffer_height,
+           (const char *) glGetString(GL_RENDERER));
+
+   return headless;
+
+error:
+   headless_cleanup(headless);
+   return NULL;
+}
+
+/* There is nothing to display, so a frame is done once it has been
+ * submitted. Only frames_in_flight frames are allowed to be queued on
+ * the GPU so that the measured rate is the real rendering throughput */
+static void
+headless_swap(struct headless_context *headless)
+{
+   EGLSyncKHR fence;
+
+   if (headless->started) {
+      headless->n_frames++;
+   } else {
+      clock_gettime(CLOCK_MONOTONIC, &headless->start_time);
+      headless->report_time = headless->start_time;
+      headless->started = true;
+   }
+
+   if (headless->create_sync == NULL) {
+      glFinish();
+      return;
+   }
+
+   fence = headless->create_sync(headless->edpy, EGL_SYNC_FENCE_KHR, NULL);
+   if (fence == EGL_NO_SYNC_KHR) {
+      glFinish();
+      return;
+   }
+   glFlush();
+
+   if (headless->n_fences >= headless->frames_in_flight) {
+      headless->client_wait_sync(headless->edpy,
+                                 headless->fences[0],
+                                 EGL_SYNC_FLUSH_COMMANDS_BIT_KHR,
+                                 EGL_FOREVER_KHR);
+      headless->destroy_sync(headless->edpy, headless->fences[0]);
+      headless->n_fences--;
+      memmove(headless->fences, headless->fences + 1,
+              headless->n_fences * sizeof headless->fences[0]);
+   }
+
+   headless->fences[headless->n_fences++] = fence;
+}
+
+static void
+headless_report(struct headless_context *headless)
+{
+   struct timespec now;
+   double seconds;
+
+   if (!headless->started)
+      return;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   seconds = timespec_diff(&now, &headless->report_time);
+
+   printf("headless: %u frames in %3.1f seconds = %6.3f frames/s\n",
+          headless->n_frames - headless->reported_frames, seconds,
+          (headless->n_frames - headless->reported_frames) / seconds);
+
+   headless->reported_frames = headless->n_frames;
+   headless->report_time = now;
+}
+
+static bool
+winsys_can_predict(const struct stereo_winsys *winsys)
+{
+   const struct gbm_dev *dev = winsys->dev;
+
+   return (winsys->headless == NULL && !dev->benchmark &&
+           dev->have_last_flip && dev->monotonic_timestamps &&
+           dev->refresh_ns != 0);
 }
 
 /**
- * Fills a gear vertex.
+ * Predicts when a frame rendered now will be scanned out. It goes out on
+ * the first vblank after the frames already waiting for scanout, and
+ * the vblanks are extrapolated from the last page flip. Until there has
+ * been a flip with a usable timestamp, and offscreen, there is nothing
+ * to go by and the current time is used instead.
  *
- * @param v the vertex to fill
- * @param x the x coordinate
- * @param y the y coordinate
- * @param z the z coortinate
- * @param n pointer to the normal table
+ * @return the CLOCK_MONOTONIC time of the scanout in nanoseconds
+ */
+static uint64_t
+winsys_predict_present(struct stereo_winsys *winsys)
+{
+   struct gbm_dev *dev = winsys->dev;
+   uint64_t now = get_time_ns(), vblanks;
+
+   if (!winsys_can_predict(winsys))
+      return now;
+
+   /* With variable refresh the frame goes out once it's ready, but not
+    * before the shortest refresh after the frames ahead of it */
+   if (dev->vrr) {
+      vblanks = get_frames_in_flight(winsys->context) + 1;
+      return MAX(now + dev->frame_cost_ns,
+                 dev->last_flip_ns + vblanks * dev->refresh_ns);
+   }
+
+   /* The next vblank, which the flip event of the last one may not have
+    * been handled for yet */
+   vblanks = 1;
+   if (now > dev->last_flip_ns)
+      vblanks = (now - dev->last_flip_ns) / dev->refresh_ns + 1;
+
+   vblanks += get_frames_in_flight(winsys->context);
+
+   return dev->last_flip_ns + vblanks * dev->refresh_ns;
+}
+
+/**
+ * Gets the time to start the next frame with late latching. That is the
+ * vblank it's predicted to go out on, less the time a frame takes to
+ * submit and the margin. If that time has already passed the frame is
+ * aimed at a later vblank, which it would have ended up on anyway.
  *
- * @return the operation error code
+ * @param target_ns set to the vblank the frame is aimed at, unless the
+ *                  frame is to be started right away
+ * @return the time in CLOCK_MONOTONIC nanoseconds, or 0 to start the
+ *         frame right away
  */
-static GearVertex *
-vert(GearVertex * v,
-     GLfloat x, GLfloat y, GLfloat z,
-     GLfloat n[3])
+static uint64_t
+winsys_get_latch_time(struct stereo_winsys *winsys, uint64_t *target_ns)
 {
-   v[0][0] = x;
-   v[0][1] = y;
-   v[0][2] = z;
-   v[0][3] = n[0];
-   v[0][4] = n[1];
-   v[0][5] = n[2];
+   struct gbm_dev *dev = winsys->dev;
+   uint64_t now, target, budget;
+
+   if (!winsys_can_predict(winsys) || !dev->late_latch)
+      return 0;
+
+   now = get_time_ns();
+   target = winsys_predict_present(winsys);
+   budget = dev->frame_cost_ns + dev->latch_margin_ns;
+
+   while (target < now + budget)
+      target += dev->refresh_ns;
+
+   *target_ns = target;
+
+   return target - budget;
+}
+
+/* Whether another frame can be rendered without blocking. This is false
+ * once the maximum number of frames are waiting to be displayed or GBM
+ * has no buffer left to render into, in which case the next frame has to
+ * wait for a page flip event */
+static bool
+winsys_can_render(struct stereo_winsys *winsys)
+{
+   struct gbm_context *context = winsys->context;
+
+   /* Offscreen rendering is only throttled by its fences in swap() */
+   if (winsys->headless)
+      return true;
+
+   if (context->queued_bo == NULL)
+      return true;
+
+   /* Older frames are dropped to make room */
+   if (winsys->dev->benchmark)
+      return gbm_surface_has_free_buffers(context->gbm_surface);
+
+   return (get_frames_in_flight(context) < context->frames_in_flight &&
+           gbm_surface_has_free_buffers(context->gbm_surface));
+}
+
+/* Handles the events that are ready on the DRM fd */
+static void
+winsys_dispatch(struct stereo_winsys *winsys)
+{
+   struct gbm_context *context = winsys->context;
+   drmEventContext evctx;
+
+   memset(&evctx, 0, sizeof(evctx));
+   evctx.version = DRM_EVENT_CONTEXT_VERSION;
+   evctx.page_flip_handler = page_flip_handler;
+   drmHandleEvent(winsys->fd, &evctx);
+
+   if (context->queued_bo && !winsys->dev->pending_swap)
+      queued_bo_done(context);
+}
+
+/**
+ * Submits a rendered frame.
+ *
+ * @param times when the frame was started and the vblank it is for
+ */
+static void
+swap(struct stereo_winsys *winsys, const struct frame_times *times)
+{
+   struct gbm_context *context = winsys->context;
+   uint64_t start = get_time_ns(), cost;
+
+   /* Offscreen the swap is waiting for the fence of an older frame */
+   if (winsys->headless) {
+      headless_swap(winsys->headless);
+      end_stage(STAGE_SWAP_BUFFERS, start);
+      return;
+   }
+
+   eglSwapBuffers(context->edpy, context->egl_surface);
+   end_stage(STAGE_SWAP_BUFFERS, start);
+
+   start = get_time_ns();
+   context->ready_times[context->n_ready_bos] = *times;
+   context->ready_bos[context->n_ready_bos++] =
+      gbm_surface_lock_front_buffer(context->gbm_surface);
+   end_stage(STAGE_LOCK_FRONT_BUFFER, start);
+
+   queue_next_bo(context);
+
+   /* Moving average over about 8 frames */
+   cost = get_time_ns() - times->latch_ns;
+   if (winsys->dev->frame_cost_ns == 0)
+      winsys->dev->frame_cost_ns = cost;
+   else
+      winsys->dev->frame_cost_ns = (winsys->dev->frame_cost_ns * 7 +
+                                    cost) / 8;
+}
+
+/* Drops any frames that haven't been queued yet and waits for the
+ * pending flip so that the CRTC can be restored */
+static void
+drain_frames(struct gbm_context *context)
+{
+   while (context->n_ready_bos > 0)
+      gbm_surface_release_buffer(context->gbm_surface,
+                                 context->ready_bos[--context->n_ready_bos]);
+
+   while (context->queued_bo)
+      wait_queued_bo(context);
+}
+
+static void
+winsys_report(struct stereo_winsys *winsys)
+{
+   struct gbm_dev *dev = winsys->dev;
+
+   if (winsys->headless) {
+      headless_report(winsys->headless);
+      return;
+   }
+
+   printf("framebuffers: %u AddFB, %u RmFB in %u presents\n",
+          dev->n_add_fb - dev->reported_add_fb,
+          dev->n_rm_fb - dev->reported_rm_fb,
+          dev->n_presents - dev->reported_presents);
+
+   dev->reported_add_fb = dev->n_add_fb;
+   dev->reported_rm_fb = dev->n_rm_fb;
+   dev->reported_presents = dev->n_presents;
+
+   printf("page flips: %u, %u vblanks missed, %s refresh %.1f us\n",
+          dev->n_flips, dev->missed_vblanks,
+          dev->vrr ? "variable, shortest" : "fixed",
+          dev->refresh_ns / 1e3);
+
+   if (dev->flip_intervals.count > 0 || dev->flip_latencies.count > 0) {
+      print_time_header();
+      if (dev->flip_intervals.count > 0)
+         print_time_row("flip interval", &dev->flip_intervals);
+      if (dev->flip_latencies.count > 0)
+         print_time_row("submit to scanout", &dev->flip_latencies);
+   }
+
+   if (dev->late_latch) {
+      printf("late latch: %u frames missed their vblank, "
+             "cost %.1f us, margin %.1f us\n",
+             dev->missed_targets, dev->frame_cost_ns / 1e3,
+             dev->latch_margin_ns / 1e3);
+   } else {
+      printf("%u frames missed their predicted vblank\n",
+             dev->missed_targets);
+   }
+
+   if (dev->latch_latencies.count > 0) {
+      print_time_header();
+      print_time_row("start to scanout", &dev->latch_latencies);
+   }
+
+   if (dev->benchmark) {
+      printf("benchmark: %u frames dropped without being presented\n",
+             dev->n_dropped);
+   }
+
+   dev->n_flips = 0;
+   dev->missed_vblanks = 0;
+   dev->missed_targets = 0;
+   dev->n_dropped = 0;
+   memset(&dev->flip_intervals, 0, sizeof dev->flip_intervals);
+   memset(&dev->flip_latencies, 0, sizeof dev->flip_latencies);
+   memset(&dev->latch_latencies, 0, sizeof dev->latch_latencies);
+}
+
+static void
+winsys_disconnect(struct stereo_winsys *winsys)
+{
+   if (winsys->headless) {
+      headless_cleanup(winsys->headless);
+      winsys->headless = NULL;
+   }
+   if (winsys->context) {
+      drain_frames(winsys->context);
+      stereo_cleanup_context(winsys->context);
+      winsys->context = NULL;
+   }
+   if (winsys->dev) {
+      stereo_cleanup_dev(winsys->dev);
+      winsys->dev = NULL;
+   }
+   if (winsys->fd != -1) {
+      close(winsys->fd);
+      winsys->fd = -1;
+   }
+}
+
+static int
+winsys_connect(struct stereo_winsys *winsys,
+               const struct stereo_options *options)
+{
+   drmModeModeInfo mode;
+   int ret;
+
+   if (options->headless) {
+      ret = make_headless_mode(&mode, options);
+      if (ret)
+         goto error;
+
+      get_layout_for_mode(&winsys->layout, &mode);
+
+      winsys->headless = headless_prepare_context(&winsys->layout, options);
+      if (winsys->headless == NULL) {
+         ret = -ENOENT;
+         goto error;
+      }
+
+      return 0;
+   }
+
+   /* open the DRM device */
+   ret = stereo_open(&winsys->fd, options);
+   if (ret)
+      goto error;
+
+   /* prepare all connectors and CRTCs */
+   winsys->dev = stereo_prepare_dev(winsys->fd, options);
+   if (winsys->dev == NULL) {
+      ret = -ENOENT;
+      goto error;
+   }
+
+   winsys->context = stereo_prepare_context(winsys->dev, options);
+   if (winsys->context == NULL) {
+      ret = -ENOENT;
+      goto error;
+   }
+
+   winsys->layout = winsys->dev->layout;
+
+   return 0;
+
+error:
+   winsys_disconnect(winsys);
+   return ret;
+}
+
+static void
+winsys_free(struct stereo_winsys *winsys)
+{
+   winsys_disconnect(winsys);
+   free(winsys);
+}
+
+static struct stereo_winsys *
+create_winsys(const struct stereo_options *options)
+{
+   struct stereo_winsys *winsys = xmalloc(sizeof *winsys);
+
+   memset(winsys, 0, sizeof *winsys);
+
+   winsys->fd = -1;
+
+   if (winsys_connect(winsys, options) != 0) {
+      winsys_free(winsys);
+      return NULL;
+   }
+
+   return winsys;
+}
+
+/**
+ * Fills a gear vertex.
+ *
+ * @param v the vertex to fill
+ * @param x the x coordinate
+ * @param y the y coordinate
+ * @param z the z coortinate
+ * @param n pointer to the normal table
+ *
+ * @return the operation error code
+ */
+static GearVertex *
+vert(GearVertex * v,
+     GLfloat x, GLfloat y, GLfloat z,
+     GLfloat n[3])
+{
+   v[0][0] = x;
+   v[0][1] = y;
+   v[0][2] = z;
+   v[0][3] = n[0];
+   v[0][4] = n[1];
+   v[0][5] = n[2];
+
+   return v + 1;
+}
+
+/**
+ * Converts triangle strips to an indexed triangle list so that the whole
+ * gear can be drawn with a single draw call.
+ *
+ * @param gear the gear to store the indices in
+ * @param geometry the arena to allocate the indices from
+ * @param strips the triangle strips comprising the gear
+ * @param nstrips the number of strips
+ */
+static void
+strips_to_triangles(struct gear *gear, struct arena *geometry,
+                    const struct vertex_strip *strips, int nstrips)
+{
+   const struct vertex_strip *strip;
+   GLushort *index;
+   int ntriangles = 0;
+   int n, i;
+
+   for (n = 0; n < nstrips; n++)
+      ntriangles += strips[n].count - 2;
+
+   gear->indices = arena_alloc(geometry,
+                               ntriangles * 3 * sizeof *gear->indices);
+   index = gear->indices;
+
+   for (n = 0; n < nstrips; n++) {
+      strip = strips + n;
+
+      for (i = 0; i < strip->count - 2; i++) {
+         /* Every other triangle of a strip has the opposite winding, so
+          * swap its first two vertices to keep it front facing */
+         index[0] = strip->first + i + (i & 1);
+         index[1] = strip->first + i + 1 - (i & 1);
+         index[2] = strip->first + i + 2;
+         index += 3;
+      }
+   }
+
+   gear->nindices = index - gear->indices;
+}
+
+/**
+ * Calculates the average cache miss ratio of an index list, ie. the
+ * number of vertex shader invocations per triangle with a FIFO
+ * post-transform cache of VERTEX_CACHE_SIZE entries.
+ */
+static float
+get_acmr(const GLushort *indices, int nindices)
+{
+   int cache[VERTEX_CACHE_SIZE];
+   int cache_pos = 0, misses = 0;
+   int i, j;
+
+   if (nindices == 0)
+      return 0.0f;
+
+   for (i = 0; i < VERTEX_CACHE_SIZE; i++)
+      cache[i] = -1;
+
+   for (i = 0; i < nindices; i++) {
+      for (j = 0; j < VERTEX_CACHE_SIZE; j++) {
+         if (cache[j] == indices[i])
+            break;
+      }
+
+      if (j == VERTEX_CACHE_SIZE) {
+         cache[cache_pos] = indices[i];
+         cache_pos = (cache_pos + 1) % VERTEX_CACHE_SIZE;
+         misses++;
+      }
+   }
+
+   return misses / (nindices / 3.0f);
+}
+
+static uint32_t
+hash_vertex(const GearVertex v)
+{
+   const uint8_t *p = (const uint8_t *) v;
+   uint32_t hash = 2166136261u;
+   size_t i;
+
+   /* FNV-1a over the bit patterns of the attributes */
+   for (i = 0; i < sizeof(GearVertex); i++)
+      hash = (hash ^ p[i]) * 16777619u;
+
+   return hash;
+}
+
+/**
+ * Merges vertices that have the same position and normal and rewrites
+ * the indices to refer to the merged vertices. Triangles that become
+ * degenerate are dropped.
+ */
+static void
+deduplicate_vertices(struct gear *gear)
+{
+   GearVertex *vertices = xmalloc(gear->nvertices * sizeof *vertices);
+   GLushort *remap = xmalloc(gear->nvertices * sizeof *remap);
+   int table_size = 1, nvertices = 0, nindices = 0;
+   int *table;
+   uint32_t slot;
+   GLushort *tri;
+   int i;
+
+   while (table_size < gear->nvertices * 2)
+      table_size *= 2;
+   table = xmalloc(table_size * sizeof *table);
+   for (i = 0; i < table_size; i++)
+      table[i] = -1;
+
+   for (i = 0; i < gear->nvertices; i++) {
+      slot = hash_vertex(gear->vertices[i]) & (table_size - 1);
+
+      while (table[slot] != -1 &&
+             memcmp(vertices[table[slot]], gear->vertices[i],
+                    sizeof(GearVertex)))
+         slot = (slot + 1) & (table_size - 1);
+
+      if (table[slot] == -1) {
+         memcpy(vertices[nvertices], gear->vertices[i], sizeof(GearVertex));
+         table[slot] = nvertices++;
+      }
+
+      remap[i] = table[slot];
+   }
+
+   for (i = 0; i < gear->nindices; i += 3) {
+      tri = gear->indices + nindices;
+      tri[0] = remap[gear->indices[i]];
+      tri[1] = remap[gear->indices[i + 1]];
+      tri[2] = remap[gear->indices[i + 2]];
+
+      if (tri[0] != tri[1] && tri[1] != tri[2] && tri[2] != tri[0])
+         nindices += 3;
+   }
+
+   free(gear->vertices);
+   gear->vertices = vertices;
+   gear->nvertices = nvertices;
+   gear->nindices = nindices;
+
+   free(table);
+   free(remap);
+}
+
+/* Picks the next fanning vertex for optimize_vertex_cache() */
+static int
+get_next_vertex(const int *candidates, int ncandidates,
+                const int *live, const int *timestamps, int time,
+                const GLushort *dead_end, int *dead_end_top,
+                int *cursor, int nvertices)
+{
+   int best = -1, best_priority = -1;
+   int priority;
+   int i, v;
+
+   /* Prefer the candidate that has been in the cache the longest but
+    * will still be there after its remaining triangles are emitted */
+   for (i = 0; i < ncandidates; i++) {
+      v = candidates[i];
+      if (live[v] <= 0)
+         continue;
+
+      priority = 0;
+      if (time - timestamps[v] + 2 * live[v] <= VERTEX_CACHE_SIZE)
+         priority = time - timestamps[v];
+
+      if (priority > best_priority) {
+         best = v;
+         best_priority = priority;
+      }
+   }
+
+   if (best != -1)
+      return best;
+
+   /* Otherwise try the recently used vertices */
+   while (*dead_end_top > 0) {
+      v = dead_end[--*dead_end_top];
+      if (live[v] > 0)
+         return v;
+   }
+
+   /* Otherwise take the next vertex in input order */
+   while (*cursor < nvertices) {
+      v = (*cursor)++;
+      if (live[v] > 0)
+         return v;
+   }
+
+   return -1;
+}
+
+/**
+ * Reorders the triangles for post-transform vertex cache reuse using the
+ * Tipsify algorithm from Sander, Nehab and Barczak, "Fast Triangle
+ * Reordering for Vertex Locality and Reduced Overdraw", and then
+ * renumbers the vertices in the order they are first used. The indices
+ * are rewritten in place.
+ */
+static void
+optimize_vertex_cache(struct gear *gear)
+{
+   int ntriangles = gear->nindices / 3;
+   int *live = xmalloc(gear->nvertices * sizeof *live);
+   int *offsets = xmalloc((gear->nvertices + 1) * sizeof *offsets);
+   int *adjacency = xmalloc(gear->nindices * sizeof *adjacency);
+   int *timestamps = xmalloc(gear->nvertices * sizeof *timestamps);
+   int *candidates = xmalloc(gear->nindices * sizeof *candidates);
+   bool *emitted = xmalloc(ntriangles * sizeof *emitted);
+   GLushort *dead_end = xmalloc(gear->nindices * sizeof *dead_end);
+   GLushort *indices = xmalloc(gear->nindices * sizeof *indices);
+   GearVertex *vertices = xmalloc(gear->nvertices * sizeof *vertices);
+   int *remap = offsets;
+   int time = VERTEX_CACHE_SIZE + 1;
+   int dead_end_top = 0, cursor = 1;
+   int ncandidates, nindices = 0, nvertices = 0;
+   int fanning;
+   int i, j, t, v;
+
+   /* Build the vertex to triangle adjacency */
+   memset(live, 0, gear->nvertices * sizeof *live);
+   for (i = 0; i < gear->nindices; i++)
+      live[gear->indices[i]]++;
+
+   offsets[0] = 0;
+   for (i = 0; i < gear->nvertices; i++)
+      offsets[i + 1] = offsets[i] + live[i];
+   for (i = 0; i < gear->nindices; i++)
+      adjacency[offsets[gear->indices[i]]++] = i / 3;
+   for (i = gear->nvertices; i > 0; i--)
+      offsets[i] = offsets[i - 1];
+   offsets[0] = 0;
+
+   memset(timestamps, 0, gear->nvertices * sizeof *timestamps);
+   memset(emitted, 0, ntriangles * sizeof *emitted);
+
+   fanning = gear->nvertices > 0 ? 0 : -1;
+
+   while (fanning >= 0) {
+      ncandidates = 0;
+
+      /* Emit all of the remaining triangles around the fanning vertex */
+      for (i = offsets[fanning]; i < offsets[fanning + 1]; i++) {
+         t = adjacency[i];
+         if (emitted[t])
+            continue;
+
+         for (j = 0; j < 3; j++) {
+            v = gear->indices[t * 3 + j];
+            indices[nindices++] = v;
+            dead_end[dead_end_top++] = v;
+            candidates[ncandidates++] = v;
+            live[v]--;
+            if (time - timestamps[v] > VERTEX_CACHE_SIZE)
+               timestamps[v] = time++;
+         }
+
+         emitted[t] = true;
+      }
+
+      fanning = get_next_vertex(candidates, ncandidates,
+                                live, timestamps, time,
+                                dead_end, &dead_end_top,
+                                &cursor, gear->nvertices);
+   }
+
+   /* Renumber the vertices in order of first use so that vertex fetches
+    * walk through the buffer linearly */
+   for (i = 0; i < gear->nvertices; i++)
+      remap[i] = -1;
+   for (i = 0; i < nindices; i++) {
+      v = indices[i];
+      if (remap[v] == -1) {
+         memcpy(vertices[nvertices], gear->vertices[v], sizeof(GearVertex));
+         remap[v] = nvertices++;
+      }
+      indices[i] = remap[v];
+   }
+
+   memcpy(gear->indices, indices, nindices * sizeof *indices);
+   free(gear->vertices);
+   gear->vertices = vertices;
+   gear->nvertices = nvertices;
+
+   free(indices);
+   free(dead_end);
+   free(emitted);
+   free(candidates);
+   free(timestamps);
+   free(adjacency);
+   free(offsets);
+   free(live);
+}
+
+/**
+ * Turns the expanded vertices and indices of a gear into a compact
+ * indexed mesh and keeps how much it saved for the report.
+ */
+static void
+optimize_gear_mesh(struct gear *gear)
+{
+   gear->unoptimized_nvertices = gear->nvertices;
+   gear->unoptimized_acmr = get_acmr(gear->indices, gear->nindices);
+
+   deduplicate_vertices(gear);
+   optimize_vertex_cache(gear);
+
+   gear->acmr = get_acmr(gear->indices, gear->nindices);
+}
+
+/**
+ * Packs a normal component into a signed 10-bit field.
+ */
+static GLuint
+pack_10(GLfloat value, int shift)
+{
+   return ((GLuint) lrintf(value * 511.0f) & 0x3ff) << shift;
+}
+
+/**
+ * Fills the buffer bound to a target with copies of some data.
+ */
+static void
+upload_copies(GLenum target, const void *data, size_t size, int copies)
+{
+   char *buf;
+   int i;
+
+   if (copies == 1) {
+      glBufferData(target, size, data, GL_STATIC_DRAW);
+      return;
+   }
+
+   buf = xmalloc(size * copies);
+   for (i = 0; i < copies; i++)
+      memcpy(buf + i * size, data, size);
+
+   glBufferData(target, size * copies, buf, GL_STATIC_DRAW);
+   free(buf);
+}
+
+/**
+ * Gets the size of a vertex in the current vertex format.
+ */
+static size_t
+get_vertex_size(void)
+{
+   return (vertex_format == VERTEX_FORMAT_FLOAT ?
+           sizeof(GearVertex) :
+           sizeof(struct packed_vertex));
+}
+
+/**
+ * Converts the vertices of a gear to the current vertex format, ready
+ * for upload_gear_vertices(), and frees the vertices it was built with.
+ *
+ * @param gear the gear whose vertices to convert
+ * @param geometry the arena to allocate the converted vertices from
+ */
+static void
+pack_gear_vertices(struct gear *gear, struct arena *geometry)
+{
+   struct packed_vertex *packed;
+   const GLfloat *v;
+   GLfloat max = 0.0f, scale, len, n[3];
+   int i, j;
+
+   if (vertex_format == VERTEX_FORMAT_FLOAT) {
+      gear->scale = 1.0f;
+      gear->vertex_data = arena_dup(geometry, gear->vertices,
+                                    gear->nvertices * sizeof(GearVertex));
+      goto out;
+   }
+
+   /* Normalize the positions by the largest coordinate. The scale is
+    * put back in the model matrix when the gear is drawn. */
+   for (i = 0; i < gear->nvertices; i++) {
+      for (j = 0; j < 3; j++) {
+         if (fabsf(gear->vertices[i][j]) > max)
+            max = fabsf(gear->vertices[i][j]);
+      }
+   }
+
+   gear->scale = max > 0.0f ? max : 1.0f;
+   scale = 32767.0f / gear->scale;
+
+   packed = arena_alloc(geometry, gear->nvertices * sizeof *packed);
+
+   for (i = 0; i < gear->nvertices; i++) {
+      v = gear->vertices[i];
+
+      for (j = 0; j < 3; j++)
+         packed[i].position[j] = lrintf(v[j] * scale);
+      packed[i].position[3] = 0;
+
+      /* The normalized formats only hold -1..1, so the normal has to be
+       * unit length to neither wrap around nor lose precision. The
+       * clamp catches rounding. */
+      len = sqrtf(v[3] * v[3] + v[4] * v[4] + v[5] * v[5]);
+      for (j = 0; j < 3; j++) {
+         n[j] = len > 0.0f ? v[3 + j] / len : 0.0f;
+         n[j] = MAX(-1.0f, MIN(n[j], 1.0f));
+      }
+
+      if (vertex_format == VERTEX_FORMAT_SHORT_BYTE) {
+         for (j = 0; j < 3; j++)
+            packed[i].normal.bytes[j] = lrintf(n[j] * 127.0f);
+         packed[i].normal.bytes[3] = 0;
+      } else if (packed_normal_type == GL_INT_2_10_10_10_REV) {
+         /* X is in the least significant bits */
+         packed[i].normal.packed = (pack_10(n[0], 0) |
+                                    pack_10(n[1], 10) |
+                                    pack_10(n[2], 20));
+      } else {
+         /* X is in the most significant bits */
+         packed[i].normal.packed = (pack_10(n[0], 22) |
+                                    pack_10(n[1], 12) |
+                                    pack_10(n[2], 2));
+      }
+   }
+
+   gear->vertex_data = packed;
+
+out:
+   free(gear->vertices);
+   gear->vertices = NULL;
+}
+
+/**
+ * Stores the converted vertices of a gear in its vertex buffer object,
+ * which must be bound.
+ *
+ * @param gear the gear whose vertices to upload
+ */
+static void
+upload_gear_vertices(struct gear *gear)
+{
+   upload_copies(GL_ARRAY_BUFFER, gear->vertex_data,
+                 gear->nvertices * get_vertex_size(), gear->batch_size);
+}
+
+/**
+ * Stores the indices of a gear in its element buffer object, which must
+ * be bound. For DRAW_MODE_BATCHED each copy of the indices refers to the
+ * next copy of the vertices, and a buffer with the copy number of each
+ * vertex is created.
+ *
+ * @param gear the gear whose indices to upload
+ */
+static void
+upload_gear_indices(struct gear *gear)
+{
+   GLushort *indices;
+   GLubyte *copy;
+   int i, j;
+
+   if (gear->batch_size == 1) {
+      glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                   gear->nindices * sizeof(*gear->indices),
+                   gear->indices, GL_STATIC_DRAW);
+      return;
+   }
+
+   indices = xmalloc(gear->batch_size * gear->nindices * sizeof *indices);
+   for (i = 0; i < gear->batch_size; i++) {
+      for (j = 0; j < gear->nindices; j++) {
+         indices[i * gear->nindices + j] =
+            gear->indices[j] + i * gear->nvertices;
+      }
+   }
+
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                gear->batch_size * gear->nindices * sizeof *indices,
+                indices, GL_STATIC_DRAW);
+   free(indices);
+
+   copy = xmalloc(gear->batch_size * gear->nvertices);
+   for (i = 0; i < gear->batch_size; i++)
+      memset(copy + i * gear->nvertices, i, gear->nvertices);
+
+   glGenBuffers(1, &gear->batch_vbo);
+   glBindBuffer(GL_ARRAY_BUFFER, gear->batch_vbo);
+   glBufferData(GL_ARRAY_BUFFER, gear->batch_size * gear->nvertices,
+                copy, GL_STATIC_DRAW);
+   free(copy);
+}
+
+/**
+ * Points the position and normal attributes at the gear vertex buffer
+ * that is currently bound.
+ */
+static void
+set_gear_attribs(void)
+{
+   switch (vertex_format) {
+   case VERTEX_FORMAT_FLOAT:
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
+                            sizeof(GearVertex), NULL);
+      glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
+                            sizeof(GearVertex), (GLfloat *) 0 + 3);
+      break;
+   case VERTEX_FORMAT_SHORT_BYTE:
+      glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE,
+                            sizeof(struct packed_vertex), NULL);
+      glVertexAttribPointer(1, 3, GL_BYTE, GL_TRUE,
+                            sizeof(struct packed_vertex),
+                            (void *) offsetof(struct packed_vertex, normal));
+      break;
+   case VERTEX_FORMAT_SHORT_PACKED:
+      glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE,
+                            sizeof(struct packed_vertex), NULL);
+      glVertexAttribPointer(1, 4, packed_normal_type, GL_TRUE,
+                            sizeof(struct packed_vertex),
+                            (void *) offsetof(struct packed_vertex, normal));
+      break;
+   }
+}
+
+/**
+ * Records the vertex attribute setup of a gear in a Vertex Array Object
+ * so that drawing it only needs a single bind.
+ *
+ * @param gear the gear whose buffers have already been created
+ */
+static void
+create_gear_vao(struct gear *gear)
+{
+   gear->vao = 0;
+
+   if (GenVertexArrays == NULL)
+      return;
+
+   GenVertexArrays(1, &gear->vao);
+   BindVertexArray(gear->vao);
+
+   glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
+   set_gear_attribs();
+   glEnableVertexAttribArray(0);
+   glEnableVertexAttribArray(1);
+
+   if (eye_vbo) {
+      glBindBuffer(GL_ARRAY_BUFFER, eye_vbo);
+      glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, NULL);
+      VertexAttribDivisor(2, 1);
+      glEnableVertexAttribArray(2);
+   }
+
+   if (gear->batch_vbo) {
+      glBindBuffer(GL_ARRAY_BUFFER, gear->batch_vbo);
+      glVertexAttribPointer(3, 1, GL_UNSIGNED_BYTE, GL_FALSE, 0, NULL);
+      glEnableVertexAttribArray(3);
+   }
+
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gear->ibo);
+
+   /* Make sure nothing else modifies the VAO */
+   BindVertexArray(0);
+}
+
+/**
+ *  Create a gear wheel. This only uses the CPU, so that the gears can be
+ *  built on several threads, and upload_gear() has to be called on the
+ *  gear afterwards.
+ *
+ *  @param scene the scene whose arenas the gear and its geometry are
+ *               allocated from
+ *  @param inner_radius radius of hole at center
+ *  @param outer_radius radius at center of teeth
+ *  @param width width of gear
+ *  @param teeth number of teeth
+ *  @param tooth_depth depth of tooth
+ *  @param lod the level of detail. GEAR_LOD_CYLINDER makes a segment of
+ *             the cylinder instead of each tooth, and should be given
+ *             a tooth depth of 0.
+ *
+ *  @return pointer to the constructed struct gear
+ */
+static struct gear *
+build_gear(struct scene *scene,
+           GLfloat inner_radius, GLfloat outer_radius,
+           GLfloat width, GLint teeth, GLfloat tooth_depth,
+           enum gear_lod lod)
+{
+   GLfloat r0, r1, r2;
+   GLfloat da;
+   GearVertex *v;
+   struct gear *gear;
+   double s[5], c[5];
+   double (*angles)[2];
+   double offsets[4][2];
+   GLfloat normal[3];
+   struct vertex_strip *strips;
+   int cur_strip = 0;
+   int i, j, next;
+
+   /* The vertices have to be addressable with 16-bit indices */
+   if (VERTICES_PER_TOOTH * teeth > 65536)
+      return NULL;
+
+   /* Allocate memory for the gear */
+   gear = arena_alloc(&scene->arena, sizeof *gear);
+
+   /* Calculate the radii used in the gear */
+   r0 = inner_radius;
+   r1 = outer_radius - tooth_depth / 2.0;
+   r2 = outer_radius + tooth_depth / 2.0;
+
+   da = 2.0 * M_PI / teeth / 4.0;
+
+   /*
+    * Build the table of the sine and cosine of the four angles of each
+    * tooth. Only the start of each tooth needs a sincos(), the other
+    * angles are rotated from it by the same offsets, in a loop that the
+    * compiler can vectorize.
+    */
+   angles = xmalloc(teeth * 4 * sizeof *angles);
+
+   for (j = 0; j < 4; j++)
+      sincos(j * da, &offsets[j][1], &offsets[j][0]);
+
+   for (i = 0; i < teeth; i++)
+      sincos(i * 2.0 * M_PI / teeth, &angles[i * 4][1], &angles[i * 4][0]);
+
+   for (j = 1; j < 4; j++) {
+      for (i = 0; i < teeth; i++) {
+         angles[i * 4 + j][0] = (angles[i * 4][0] * offsets[j][0] -
+                                 angles[i * 4][1] * offsets[j][1]);
+         angles[i * 4 + j][1] = (angles[i * 4][1] * offsets[j][0] +
+                                 angles[i * 4][0] * offsets[j][1]);
+      }
+   }
+
+   /* Allocate memory for the triangle strip information */
+   strips = xmalloc(tooth_strips[lod] * teeth * sizeof(*strips));
+
+   /* Allocate memory for the vertices */
+   gear->vertices =
+      xmalloc(tooth_vertices[lod] * teeth * sizeof(*gear->vertices));
+
+   for (i = 0; i < teeth; i++) {
+      /* Each tooth fills its own part of the vertices and strips */
+      v = gear->vertices + i * tooth_vertices[lod];
+      cur_strip = i * tooth_strips[lod];
+
+      /* The sin/cos of the angles of the tooth, ending with exactly the
+       * same angle as the start of the next tooth so that the shared
+       * vertices can be merged */
+      next = (i + 1) % teeth;
+      for (j = 0; j < 5; j++) {
+         c[j] = angles[j < 4 ? i * 4 + j : next * 4][0];
+         s[j] = angles[j < 4 ? i * 4 + j : next * 4][1];
+      }
+
+      /* A set of macros for making the creation of the
+       * gears easier */
+#define  GEAR_POINT(r, da) { (r) * c[(da)], (r) * s[(da)] }
+#define  SET_NORMAL(x, y, z) do {                               \
+         normal[0] = (x); normal[1] = (y); normal[2] = (z);     \
+      } while(0)
+
+#define  GEAR_VERT(v, point, sign)                                      \
+      vert((v), p[(point)].x, p[(point)].y, (sign) * width * 0.5, normal)
+
+#define START_STRIP do {                                        \
+         strips[cur_strip].first = v - gear->vertices;          \
+      } while(0);
+
+#define END_STRIP do {                          \
+         int _tmp = (v - gear->vertices);       \
+         strips[cur_strip].count = _tmp -       \
+            strips[cur_strip].first;            \
+         cur_strip++;                           \
+      } while (0)
+
+      /* The normal is the edge turned outwards, scaled to unit length
+       * because the packed vertex formats can't hold longer ones */
+#define QUAD_WITH_NORMAL(p1, p2) do {                   \
+         GLfloat _dx = p[(p1)].x - p[(p2)].x;           \
+         GLfloat _dy = p[(p1)].y - p[(p2)].y;           \
+         GLfloat _len = hypotf(_dx, _dy);               \
+         SET_NORMAL(_dy / _len, -_dx / _len, 0);        \
+         v = GEAR_VERT(v, (p1), -1);                    \
+         v = GEAR_VERT(v, (p1), 1);                     \
+         v = GEAR_VERT(v, (p2), -1);                    \
+         v = GEAR_VERT(v, (p2), 1);                     \
+      } while(0)
+
+      struct point {
+         GLfloat x;
+         GLfloat y;
+      };
+
+      if (lod != GEAR_LOD_FULL) {
+         /* A pointed tooth from the root at the start of the tooth to
+          * the root of the next tooth, without the top and the bottom
+          * land. The cylinder leaves out the tip. */
+         struct point p[5] = {
+            GEAR_POINT(r1, 0),      // 0
+            GEAR_POINT(r2, 2),      // 1
+            GEAR_POINT(r1, 4),      // 2
+            GEAR_POINT(r0, 0),      // 3
+            GEAR_POINT(r0, 4),      // 4
+         };
+
+         /* Front face */
+         START_STRIP;
+         SET_NORMAL(0, 0, 1.0);
+         if (lod == GEAR_LOD_SIMPLE) {
+            v = GEAR_VERT(v, 1, +1);
+            v = GEAR_VERT(v, 2, +1);
+            v = GEAR_VERT(v, 0, +1);
+            v = GEAR_VERT(v, 4, +1);
+            v = GEAR_VERT(v, 3, +1);
+         } else {
+            v = GEAR_VERT(v, 0, +1);
+            v = GEAR_VERT(v, 2, +1);
+            v = GEAR_VERT(v, 3, +1);
+            v = GEAR_VERT(v, 4, +1);
+         }
+         END_STRIP;
+
+         /* Inner face */
+         START_STRIP;
+         QUAD_WITH_NORMAL(3, 4);
+         END_STRIP;
+
+         /* Back face */
+         START_STRIP;
+         SET_NORMAL(0, 0, -1.0);
+         v = GEAR_VERT(v, 3, -1);
+         v = GEAR_VERT(v, 4, -1);
+         v = GEAR_VERT(v, 0, -1);
+         v = GEAR_VERT(v, 2, -1);
+         if (lod == GEAR_LOD_SIMPLE)
+            v = GEAR_VERT(v, 1, -1);
+         END_STRIP;
+
+         /* Outer face */
+         if (lod == GEAR_LOD_SIMPLE) {
+            START_STRIP;
+            QUAD_WITH_NORMAL(1, 0);
+            END_STRIP;
+
+            START_STRIP;
+            QUAD_WITH_NORMAL(2, 1);
+            END_STRIP;
+         } else {
+            START_STRIP;
+            QUAD_WITH_NORMAL(2, 0);
+            END_STRIP;
+         }
+
+         continue;
+      }
+
+      /* Create the 7 points (only x,y coords) used to draw a tooth */
+      struct point p[7] = {
+         GEAR_POINT(r2, 1),      // 0
+         GEAR_POINT(r2, 2),      // 1
+         GEAR_POINT(r1, 0),      // 2
+         GEAR_POINT(r1, 3),      // 3
+         GEAR_POINT(r0, 0),      // 4
+         GEAR_POINT(r1, 4),      // 5
+         GEAR_POINT(r0, 4),      // 6
+      };
+
+      /* Front face */
+      START_STRIP;
+      SET_NORMAL(0, 0, 1.0);
+      v = GEAR_VERT(v, 0, +1);
+      v = GEAR_VERT(v, 1, +1);
+      v = GEAR_VERT(v, 2, +1);
+      v = GEAR_VERT(v, 3, +1);
+      v = GEAR_VERT(v, 4, +1);
+      v = GEAR_VERT(v, 5, +1);
+      v = GEAR_VERT(v, 6, +1);
+      END_STRIP;
+
+      /* Inner face */
+      START_STRIP;
+      QUAD_WITH_NORMAL(4, 6);
+      END_STRIP;
+
+      /* Back face */
+      START_STRIP;
+      SET_NORMAL(0, 0, -1.0);
+      v = GEAR_VERT(v, 6, -1);
+      v = GEAR_VERT(v, 5, -1);
+      v = GEAR_VERT(v, 4, -1);
+      v = GEAR_VERT(v, 3, -1);
+      v = GEAR_VERT(v, 2, -1);
+      v = GEAR_VERT(v, 1, -1);
+      v = GEAR_VERT(v, 0, -1);
+      END_STRIP;
+
+      /* Outer face */
+      START_STRIP;
+      QUAD_WITH_NORMAL(0, 2);
+      END_STRIP;
+
+      START_STRIP;
+      QUAD_WITH_NORMAL(1, 0);
+      END_STRIP;
+
+      START_STRIP;
+      QUAD_WITH_NORMAL(3, 1);
+      END_STRIP;
+
+      START_STRIP;
+      QUAD_WITH_NORMAL(5, 3);
+      END_STRIP;
+   }
+
+   gear->nvertices = teeth * tooth_vertices[lod];
+   assert(v == gear->vertices + gear->nvertices);
+   assert(cur_strip == teeth * tooth_strips[lod]);
+
+   free(angles);
+
+   /* Merge the duplicated vertices of the strips into an indexed mesh */
+   strips_to_triangles(gear, &scene->geometry, strips, cur_strip);
+   free(strips);
+
+   optimize_gear_mesh(gear);
+
+   gear->bounding_radius = hypotf(r2, width * 0.5f);
+
+   /* Batches of gears need copies of the mesh, as many as can be
+    * addressed with 16-bit indices */
+   gear->batch_size = MIN(batch_size, 65536 / gear->nvertices);
+   gear->batch_vbo = 0;
+
+   /* The geometry stays in the arena until the gear is uploaded */
+   pack_gear_vertices(gear, &scene->geometry);
+
+   return gear;
+}
+
+/**
+ * Creates the buffers of a gear built by build_gear().
+ */
+static void
+upload_gear(struct gear *gear)
+{
+   /* Store the vertices in a vertex buffer object (VBO) */
+   glGenBuffers(1, &gear->vbo);
+   glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
+   upload_gear_vertices(gear);
+
+   /* Store the triangle indices in an element buffer */
+   glGenBuffers(1, &gear->ibo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gear->ibo);
+   upload_gear_indices(gear);
+
+   create_gear_vao(gear);
+}
+
+/* Outer radius per tooth of the laid out gears, so that they all have the
+ * same tooth size and mesh */
+#define GEAR_MODULE 0.2f
+#define GEAR_TOOTH_DEPTH 0.7f
+/* Gap between the pitch circles of meshing gears and between the tips
+ * of gears which aren't meshing */
+#define GEAR_CLEARANCE 0.1f
+/* Number of failed attempts to attach a gear to another before moving
+ * on to the next one */
+#define MAX_ATTACH_FAILURES 8
+
+static bool
+gear_params_equal(const struct gear_params *a, const struct gear_params *b)
+{
+   return (a->inner_radius == b->inner_radius &&
+           a->outer_radius == b->outer_radius &&
+           a->width == b->width &&
+           a->teeth == b->teeth &&
+           a->tooth_depth == b->tooth_depth);
+}
+
+/**
+ * Finds the mesh with the given parameters or adds it. The gears of the
+ * new mesh are made later by create_scene_meshes().
+ *
+ * @return the index of the mesh in the scene's meshes
+ */
+static int
+get_scene_mesh(struct scene *scene, const struct gear_params *params)
+{
+   struct gear_mesh *mesh;
+   int i;
+
+   for (i = 0; i < scene->n_meshes; i++) {
+      if (gear_params_equal(&scene->meshes[i].params, params))
+         return i;
+   }
+
+   if (scene->n_meshes >= scene->meshes_size) {
+      scene->meshes_size = scene->meshes_size ? scene->meshes_size * 2 : 8;
+      scene->meshes = realloc(scene->meshes,
+                              scene->meshes_size * sizeof *scene->meshes);
+      if (scene->meshes == NULL)
+         abort();
+   }
+
+   mesh = scene->meshes + scene->n_meshes;
+   memset(mesh, 0, sizeof *mesh);
+   mesh->params = *params;
+
+   return scene->n_meshes++;
+}
+
+/**
+ * Work shared between the threads of parallel_for().
+ */
+struct parallel_work {
+   void (*func)(int index, void *data);
+   void *data;
+   int count;
+   /** The next index to hand out */
+   int next;
+};
+
+static void *
+parallel_work_thread(void *data)
+{
+   struct parallel_work *work = data;
+   int index;
+
+   while ((index = __atomic_fetch_add(&work->next, 1,
+                                      __ATOMIC_RELAXED)) < work->count)
+      work->func(index, work->data);
+
+   return NULL;
+}
+
+/**
+ * Calls a function for every index from 0 to count - 1, spread across
+ * threads. The calling thread takes part, so everything still gets done
+ * if no threads can be started.
+ *
+ * @param n_threads the number of threads to use including this one
+ */
+static void
+parallel_for(int count, int n_threads,
+             void (*func)(int index, void *data), void *data)
+{
+   struct parallel_work work = { func, data, count, 0 };
+   pthread_t *threads;
+   int n_started = 0, i;
+
+   n_threads = MIN(n_threads, count);
+   threads = xmalloc(MAX(n_threads, 1) * sizeof *threads);
+
+   for (i = 1; i < n_threads; i++) {
+      if (pthread_create(threads + n_started, NULL,
+                         parallel_work_thread, &work) == 0)
+         n_started++;
+   }
+
+   parallel_work_thread(&work);
+
+   for (i = 0; i < n_started; i++)
+      pthread_join(threads[i], NULL);
+
+   free(threads);
+}
+
+static void
+build_mesh_lod(int index, void *data)
+{
+   struct scene *scene = data;
+   struct gear_mesh *mesh = scene->meshes + index / N_GEAR_LODS;
+   const struct gear_params *params = &mesh->params;
+   enum gear_lod lod = index % N_GEAR_LODS;
+
+   if (lod == GEAR_LOD_CYLINDER) {
+      mesh->lods[lod] = build_gear(scene,
+                                   params->inner_radius,
+                                   params->outer_radius,
+                                   params->width,
+                                   MIN(params->teeth, CYLINDER_SEGMENTS),
+                                   0.0f,
+                                   lod);
+   } else {
+      mesh->lods[lod] = build_gear(scene,
+                                   params->inner_radius,
+                                   params->outer_radius,
+                                   params->width,
+                                   params->teeth,
+                                   params->tooth_depth,
+                                   lod);
+   }
+
+   if (mesh->lods[lod] == NULL)
+      abort();
+}
+
+/*
+ * The gear meshes are cached on disk so that large scenes start without
+ * building them again. Each mesh is stored in a file of its own with all
+ * of its levels of detail, ready to upload in the current vertex format,
+ * so that the buffers can be filled straight from the mapped file.
+ */
+
+#define MESH_CACHE_MAGIC "GEARMESH"
+/* Must be bumped whenever the meshes or the file layout change */
+#define MESH_CACHE_VERSION 4
+/* Alignment of the arrays in the file */
+#define MESH_CACHE_ALIGN 16
+
+/**
+ * Everything that the contents of a cache file depend on. It is zeroed
+ * before it is filled in so that it can be compared and hashed as bytes.
+ */
+struct mesh_cache_key {
+   uint32_t version;
+   uint32_t vertex_format;
+   uint32_t normal_type;
+   struct gear_params params;
+};
+
+/**
+ * Where a level of detail of the mesh is in a cache file.
+ */
+struct mesh_cache_lod {
+   uint32_t nvertices, nindices;
+   GLfloat scale, bounding_radius;
+   /** Offsets of the vertices and indices from the start of the file */
+   uint64_t vertex_offset, index_offset;
+};
+
+struct mesh_cache_header {
+   char magic[8];
+   struct mesh_cache_key key;
+   /** FNV-1a hash of the whole file with this field zeroed */
+   uint32_t checksum;
+   /** Size of the whole file */
+   uint64_t size;
+   struct mesh_cache_lod lods[N_GEAR_LODS];
+};
+
+static uint32_t
+fnv1a(uint32_t hash, const void *data, size_t size)
+{
+   const uint8_t *p = data;
+   size_t i;
+
+   for (i = 0; i < size; i++)
+      hash = (hash ^ p[i]) * 16777619u;
+
+   return hash;
+}
+
+#define FNV1A_INIT 2166136261u
+
+/**
+ * Hashes a cache file, which starts with its header, as if the checksum
+ * in the header was 0.
+ */
+static uint32_t
+get_mesh_cache_checksum(const uint8_t *file, size_t size)
+{
+   struct mesh_cache_header header;
+   uint32_t hash;
+
+   memcpy(&header, file, sizeof header);
+   header.checksum = 0;
+
+   hash = fnv1a(FNV1A_INIT, &header, sizeof header);
+
+   return fnv1a(hash, file + sizeof header, size - sizeof header);
+}
+
+static void
+get_mesh_cache_key(const struct gear_mesh *mesh, struct mesh_cache_key *key)
+{
+   memset(key, 0, sizeof *key);
+   key->version = MESH_CACHE_VERSION;
+   key->vertex_format = vertex_format;
+   key->normal_type = (vertex_format == VERTEX_FORMAT_SHORT_PACKED ?
+                       packed_normal_type : 0);
+   key->params = mesh->params;
+}
+
+/**
+ * Gets the name of the cache file of a mesh, which is in
+ * $XDG_CACHE_HOME/stereo-es2gears or ~/.cache/stereo-es2gears.
+ *
+ * @param dir_only whether to stop at the directory
+ * @return a newly allocated path, or NULL if there is no cache directory
+ */
+static char *
+get_mesh_cache_path(const struct mesh_cache_key *key, bool dir_only)
+{
+   const char *base = getenv("XDG_CACHE_HOME");
+   const char *suffix = "";
+   char *path;
+   int len;
+
+   if (base == NULL || base[0] != '/') {
+      base = getenv("HOME");
+      suffix = "/.cache";
+      if (base == NULL || base[0] != '/')
+         return NULL;
+   }
+
+   len = snprintf(NULL, 0, "%s%s/stereo-es2gears/%08x.mesh",
+                  base, suffix, 0u);
+   path = xmalloc(len + 1);
+
+   if (dir_only) {
+      snprintf(path, len + 1, "%s%s/stereo-es2gears", base, suffix);
+   } else {
+      snprintf(path, len + 1, "%s%s/stereo-es2gears/%08x.mesh",
+               base, suffix, fnv1a(FNV1A_INIT, key, sizeof *key));
+   }
+
+   return path;
+}
+
+/**
+ * Loads the gears of a mesh from its cache file if it has a valid one.
+ * The gears point into the mapped file, which stays mapped until they
+ * have been uploaded.
+ *
+ * @param arena the arena to allocate the gears from
+ * @return whether the gears were loaded
+ */
+static bool
+load_cached_mesh(struct gear_mesh *mesh, struct arena *arena)
+{
+   const struct mesh_cache_header *header;
+   const struct mesh_cache_lod *cached;
+   struct mesh_cache_key key;
+   struct stat st;
+   struct gear *gear;
+   const uint8_t *map;
+   const GLushort *indices;
+   uint64_t end;
+   uint32_t i;
+   char *path;
+   int fd, lod;
+
+   get_mesh_cache_key(mesh, &key);
+
+   path = get_mesh_cache_path(&key, false);
+   if (path == NULL)
+      return false;
+
+   fd = open(path, O_RDONLY | O_CLOEXEC);
+   free(path);
+   if (fd == -1)
+      return false;
+
+   if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof *header) {
+      close(fd);
+      return false;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return false;
+
+   header = (const struct mesh_cache_header *) map;
+
+   if (memcmp(header->magic, MESH_CACHE_MAGIC, sizeof header->magic) ||
+       memcmp(&header->key, &key, sizeof key) ||
+       header->size != (uint64_t) st.st_size ||
+       header->checksum != get_mesh_cache_checksum(map, st.st_size))
+      goto invalid;
+
+   for (lod = 0; lod < N_GEAR_LODS; lod++) {
+      cached = header->lods + lod;
+
+      if (cached->nvertices == 0 || cached->nvertices > 65536 ||
+          cached->nindices == 0 || cached->nindices % 3 != 0)
+         goto invalid;
+
+      end = cached->vertex_offset +
+         (uint64_t) cached->nvertices * get_vertex_size();
+      if (cached->vertex_offset % MESH_CACHE_ALIGN || end > header->size)
+         goto invalid;
+
+      end = cached->index_offset +
+         (uint64_t) cached->nindices * sizeof(GLushort);
+      if (cached->index_offset % MESH_CACHE_ALIGN || end > header->size)
+         goto invalid;
+
+      indices = (const GLushort *) (map + cached->index_offset);
+      for (i = 0; i < cached->nindices; i++) {
+         if (indices[i] >= cached->nvertices)
+            goto invalid;
+      }
+   }
+
+   for (lod = 0; lod < N_GEAR_LODS; lod++) {
+      cached = header->lods + lod;
+
+      gear = arena_alloc(arena, sizeof *gear);
+      memset(gear, 0, sizeof *gear);
+      gear->vertex_data = map + cached->vertex_offset;
+      gear->nvertices = cached->nvertices;
+      gear->indices = (GLushort *) (map + cached->index_offset);
+      gear->nindices = cached->nindices;
+      gear->scale = cached->scale;
+      gear->bounding_radius = cached->bounding_radius;
+      gear->batch_size = MIN(batch_size, 65536 / gear->nvertices);
+
+      mesh->lods[lod] = gear;
+   }
+
+   mesh->cache_map = (void *) map;
+   mesh->cache_size = st.st_size;
+
+   return true;
+
+invalid:
+   munmap((void *) map, st.st_size);
+   return false;
+}
+
+static size_t
+align_cache_offset(size_t offset)
+{
+   return (offset + MESH_CACHE_ALIGN - 1) & ~(size_t) (MESH_CACHE_ALIGN - 1);
+}
+
+/**
+ * Writes the gears of a mesh to its cache file. The file is written
+ * under a temporary name and then renamed so that other instances never
+ * see it half written. Failures are ignored because the cache is only
+ * there to speed up the next start.
+ */
+static void
+save_cached_mesh(const struct gear_mesh *mesh)
+{
+   struct mesh_cache_header *header;
+   struct mesh_cache_lod *cached;
+   const struct gear *gear;
+   char *path, *dir, *tmp_path;
+   uint8_t *buf;
+   size_t size = sizeof *header, len;
+   ssize_t written;
+   int fd, lod;
+   bool ok;
+
+   buf = xmalloc(sizeof *header);
+   header = (struct mesh_cache_header *) buf;
+   memset(header, 0, sizeof *header);
+   memcpy(header->magic, MESH_CACHE_MAGIC, sizeof header->magic);
+   get_mesh_cache_key(mesh, &header->key);
+
+   for (lod = 0; lod < N_GEAR_LODS; lod++) {
+      gear = mesh->lods[lod];
+      cached = header->lods + lod;
+
+      cached->nvertices = gear->nvertices;
+      cached->nindices = gear->nindices;
+      cached->scale = gear->scale;
+      cached->bounding_radius = gear->bounding_radius;
+
+      cached->vertex_offset = align_cache_offset(size);
+      size = cached->vertex_offset + gear->nvertices * get_vertex_size();
+      cached->index_offset = align_cache_offset(size);
+      size = cached->index_offset + gear->nindices * sizeof(GLushort);
+   }
+
+   header->size = size;
+
+   buf = realloc(buf, size);
+   if (buf == NULL)
+      abort();
+   header = (struct mesh_cache_header *) buf;
+   memset(buf + sizeof *header, 0, size - sizeof *header);
+
+   for (lod = 0; lod < N_GEAR_LODS; lod++) {
+      gear = mesh->lods[lod];
+      cached = header->lods + lod;
+
+      memcpy(buf + cached->vertex_offset, gear->vertex_data,
+             gear->nvertices * get_vertex_size());
+      memcpy(buf + cached->index_offset, gear->indices,
+             gear->nindices * sizeof(GLushort));
+   }
+
+   header->checksum = get_mesh_cache_checksum(buf, size);
+
+   path = get_mesh_cache_path(&header->key, false);
+   dir = get_mesh_cache_path(&header->key, true);
+   if (path == NULL) {
+      free(buf);
+      return;
+   }
+
+   /* Make the cache directory and its parent if needed */
+   *strrchr(dir, '/') = '\0';
+   mkdir(dir, 0755);
+   dir[strlen(dir)] = '/';
+   mkdir(dir, 0755);
+
+   len = strlen(path) + 32;
+   tmp_path = xmalloc(len);
+   snprintf(tmp_path, len, "%s.%d.tmp", path, (int) getpid());
+
+   fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+   if (fd != -1) {
+      written = write(fd, buf, size);
+      ok = written == (ssize_t) size;
+      ok = close(fd) == 0 && ok;
+
+      if (!ok || rename(tmp_path, path) == -1)
+         unlink(tmp_path);
+   }
+
+   free(tmp_path);
+   free(dir);
+   free(path);
+   free(buf);
+}
+
+/**
+ * Work for build_missing_mesh_lod() to hand out to the threads.
+ */
+struct mesh_build_work {
+   struct scene *scene;
+   /** The indices of the meshes to build */
+   const int *meshes;
+};
+
+static void
+build_missing_mesh_lod(int index, void *data)
+{
+   const struct mesh_build_work *work = data;
+   int mesh = work->meshes[index / N_GEAR_LODS];
+
+   build_mesh_lod(mesh * N_GEAR_LODS + index % N_GEAR_LODS, work->scene);
+}
+
+/**
+ * Prints what optimizing the meshes that were built saved, all levels of
+ * detail together. The ACMRs are weighted by the number of triangles.
+ */
+static void
+report_mesh_optimization(const struct scene *scene,
+                         const int *built, int n_built)
+{
+   const struct gear *gear;
+   long old_nvertices = 0, new_nvertices = 0, ntriangles = 0;
+   double old_misses = 0.0, new_misses = 0.0;
+   int i, lod;
+
+   if (n_built == 0)
+      return;
+
+   for (i = 0; i < n_built; i++) {
+      for (lod = 0; lod < N_GEAR_LODS; lod++) {
+         gear = scene->meshes[built[i]].lods[lod];
+         old_nvertices += gear->unoptimized_nvertices;
+         new_nvertices += gear->nvertices;
+         ntriangles += gear->nindices / 3;
+         old_misses += gear->unoptimized_acmr * (gear->nindices / 3);
+         new_misses += gear->acmr * (gear->nindices / 3);
+      }
+   }
+
+   printf("gear meshes: %d built, %li -> %li vertices, "
+          "%zu -> %zu bytes, ACMR %.3f -> %.3f\n",
+          n_built * N_GEAR_LODS, old_nvertices, new_nvertices,
+          old_nvertices * sizeof(GearVertex),
+          new_nvertices * sizeof(GearVertex),
+          old_misses / ntriangles, new_misses / ntriangles);
+}
+
+/**
+ * Makes the gears of every mesh at every level of detail. Meshes that
+ * are in the cache are loaded from it. The rest are built on a number of
+ * threads, each taking a whole gear at a time because optimizing the
+ * mesh takes most of the time and can't be split, and then saved to the
+ * cache. Everything is uploaded on this thread.
+ *
+ * @param options the options with the number of threads to build the
+ *                gears on and whether to use the cache
+ */
+static void
+create_scene_meshes(struct scene *scene,
+                    const struct stereo_options *options)
+{
+   struct mesh_build_work work = { scene, NULL };
+   struct timespec start, built, end;
+   struct gear_mesh *mesh;
+   size_t built_size, mapped_size = 0;
+   int *missing;
+   int n_missing = 0, i, lod;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   missing = xmalloc(MAX(scene->n_meshes, 1) * sizeof *missing);
+
+   for (i = 0; i < scene->n_meshes; i++) {
+      if (options->no_mesh_cache || !load_cached_mesh(scene->meshes + i,
+                                                     &scene->arena))
+         missing[n_missing++] = i;
+   }
+
+   work.meshes = missing;
+   parallel_for(n_missing * N_GEAR_LODS, options->threads,
+                build_missing_mesh_lod, &work);
+
+   if (!options->no_mesh_cache) {
+      for (i = 0; i < n_missing; i++)
+         save_cached_mesh(scene->meshes + missing[i]);
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &built);
+
+   for (i = 0; i < scene->n_meshes; i++) {
+      mesh = scene->meshes + i;
+
+      for (lod = 0; lod < N_GEAR_LODS; lod++) {
+         upload_gear(mesh->lods[lod]);
+         mesh->lods[lod]->vertex_data = NULL;
+         mesh->lods[lod]->indices = NULL;
+      }
+
+      if (mesh->cache_map) {
+         munmap(mesh->cache_map, mesh->cache_size);
+         mapped_size += mesh->cache_size;
+         mesh->cache_map = NULL;
+      }
+   }
+
+   /* The buffers have their own copy of the geometry now */
+   built_size = scene->geometry.reserved;
+   arena_free(&scene->geometry);
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   if (options->no_mesh_cache) {
+      printf("meshes: %d built on %d threads in %.1f ms, "
+             "uploaded in %.1f ms\n",
+             scene->n_meshes * N_GEAR_LODS, options->threads,
+             timespec_diff(&built, &start) * 1e3,
+             timespec_diff(&end, &built) * 1e3);
+   } else {
+      printf("meshes: %d cache hits, %d misses built on %d threads, "
+             "loaded in %.1f ms, uploaded in %.1f ms\n",
+             scene->n_meshes - n_missing, n_missing, options->threads,
+             timespec_diff(&built, &start) * 1e3,
+             timespec_diff(&end, &built) * 1e3);
+   }
+
+   report_mesh_optimization(scene, missing, n_missing);
+
+   printf("memory: %zu KiB of built and %zu KiB of mapped geometry "
+          "released after upload\n",
+          built_size / 1024, mapped_size / 1024);
+
+   free(missing);
+}
+
+static void
+scene_init(struct scene *scene, int n_gears)
+{
+   struct arena *arena = &scene->arena;
+
+   memset(scene, 0, sizeof *scene);
+   arena_init(&scene->arena);
+   arena_init(&scene->geometry);
+
+   scene->gears_size = n_gears;
+   scene->x = arena_alloc(arena, n_gears * sizeof *scene->x);
+   scene->y = arena_alloc(arena, n_gears * sizeof *scene->y);
+   scene->phase = arena_alloc(arena, n_gears * sizeof *scene->phase);
+   scene->ratio = arena_alloc(arena, n_gears * sizeof *scene->ratio);
+   scene->color = arena_alloc(arena, n_gears * sizeof *scene->color);
+   scene->mesh = arena_alloc(arena, n_gears * sizeof *scene->mesh);
+}
+
+static void
+scene_add_gear(struct scene *scene, const struct gear_params *params,
+               GLfloat x, GLfloat y, GLfloat phase, GLfloat ratio,
+               const GLfloat color[4])
+{
+   int i = scene->n_gears++;
+
+   assert(i < scene->gears_size);
+
+   scene->x[i] = x;
+   scene->y[i] = y;
+   scene->phase[i] = phase;
+   scene->ratio[i] = ratio;
+   memcpy(scene->color[i], color, sizeof scene->color[i]);
+   scene->mesh[i] = get_scene_mesh(scene, params);
+}
+
+/**
+ * Creates the three gears of the original gears demo.
+ */
+static void
+create_classic_scene(struct scene *scene)
+{
+   static const struct gear_params params[3] = {
+      { 1.0, 4.0, 1.0, 20, 0.7 },
+      { 0.5, 2.0, 2.0, 10, 0.7 },
+      { 1.3, 2.0, 0.5, 10, 0.7 },
+   };
+   static const GLfloat red[4] = { 0.8, 0.1, 0.0, 1.0 };
+   static const GLfloat green[4] = { 0.0, 0.8, 0.2, 1.0 };
+   static const GLfloat blue[4] = { 0.2, 0.2, 1.0, 1.0 };
+
+   scene_init(scene, 3);
+
+   scene_add_gear(scene, params + 0, -3.0, -2.0, 0.0, 1.0, red);
+   scene_add_gear(scene, params + 1, 3.1, -2.0, -9.0, -2.0, green);
+   scene_add_gear(scene, params + 2, -3.1, 4.2, -25.0, -2.0, blue);
+}
+
+static uint32_t
+scene_random(uint32_t *state)
+{
+   /* xorshift32, so that the layout is the same on every run */
+   *state ^= *state << 13;
+   *state ^= *state >> 17;
+   *state ^= *state << 5;
+
+   return *state;
+}
+
+static GLfloat
+scene_random_float(uint32_t *state)
+{
+   return (scene_random(state) >> 8) / (GLfloat) (1 << 24);
+}
+
+/**
+ * Picks the color of a laid out gear by stepping around the hue circle
+ * by the golden angle so that neighbours are easy to tell apart.
+ */
+static void
+get_gear_color(int index, GLfloat color[4])
+{
+   GLfloat h = fmodf(index * 0.618034f, 1.0f) * 6.0f;
+   GLfloat f = h - floorf(h);
+   const GLfloat v = 0.9f, p = v * 0.2f;
+   GLfloat q = v * (1.0f - 0.8f * f), t = v * (1.0f - 0.8f * (1.0f - f));
+
+   switch ((int) h) {
+   case 0: color[0] = v; color[1] = t; color[2] = p; break;
+   case 1: color[0] = q; color[1] = v; color[2] = p; break;
+   case 2: color[0] = p; color[1] = v; color[2] = t; break;
+   case 3: color[0] = p; color[1] = q; color[2] = v; break;
+   case 4: color[0] = t; color[1] = p; color[2] = v; break;
+   default: color[0] = v; color[1] = p; color[2] = q; break;
+   }
+
+   color[3] = 1.0f;
+}
+
+static GLfloat
+get_tip_radius(const struct scene *scene, int gear)
+{
+   const struct gear_params *params = &scene->meshes[scene->mesh[gear]].params;
+
+   return params->outer_radius + params->tooth_depth / 2.0f;
+}
+
+/**
+ * Uniform grid over the gears used to find the neighbours of a new gear
+ * while laying out the scene. The cells are hashed into a fixed number
+ * of buckets which are linked lists of gears.
+ */
+struct scene_grid {
+   GLfloat cell_size;
+   uint32_t mask;
+   int *heads;
+   int *next;
+};
+
+static uint32_t
+grid_bucket(const struct scene_grid *grid, int cx, int cy)
+{
+   return ((uint32_t) cx * 73856093u ^ (uint32_t) cy * 19349663u) & grid->mask;
+}
+
+static void
+grid_insert(struct scene_grid *grid, const struct scene *scene, int gear)
+{
+   uint32_t bucket = grid_bucket(grid,
+                                 floorf(scene->x[gear] / grid->cell_size),
+                                 floorf(scene->y[gear] / grid->cell_size));
+
+   grid->next[gear] = grid->heads[bucket];
+   grid->heads[bucket] = gear;
+}
+
+/**
+ * Checks whether a gear would fit at a position without touching any
+ * gear other than the one it meshes with.
+ */
+static bool
+grid_fits(const struct scene_grid *grid, const struct scene *scene,
+          GLfloat x, GLfloat y, GLfloat tip_radius, int parent)
+{
+   int cx = floorf(x / grid->cell_size);
+   int cy = floorf(y / grid->cell_size);
+   GLfloat dx, dy, min_distance;
+   int i, j, gear;
+
+   for (j = cy - 1; j <= cy + 1; j++) {
+      for (i = cx - 1; i <= cx + 1; i++) {
+         for (gear = grid->heads[grid_bucket(grid, i, j)];
+              gear != -1;
+              gear = grid->next[gear]) {
+            if (gear == parent)
+               continue;
+
+            dx = scene->x[gear] - x;
+            dy = scene->y[gear] - y;
+            min_distance = (get_tip_radius(scene, gear) + tip_radius +
+                            GEAR_CLEARANCE);
+
+            if (dx * dx + dy * dy < min_distance * min_distance)
+               return false;
+         }
+      }
+   }
+
+   return true;
+}
+
+static void
+make_gear_params(struct gear_params *params, int teeth, uint32_t *rng)
+{
+   static const GLfloat widths[] = { 0.5, 1.0, 2.0 };
+   static const GLfloat holes[] = { 0.25, 0.5 };
+
+   params->outer_radius = teeth * GEAR_MODULE;
+   params->inner_radius =
+      params->outer_radius * holes[scene_random(rng) % 2];
+   params->width = widths[scene_random(rng) % 3];
+   params->teeth = teeth;
+   params->tooth_depth = GEAR_TOOTH_DEPTH;
+}
+
+/**
+ * Calculates the rotation that a gear needs to mesh with another one.
+ * Each tooth of a gear is centered 3/8 of the way into its pitch. The
+ * child needs a gap pointing at the parent where the parent has a tooth
+ * pointing at the child. This stays true as they turn because the same
+ * number of teeth pass the contact point on both gears.
+ *
+ * @param direction the direction from the parent to the child in degrees
+ */
+static GLfloat
+get_meshing_phase(GLfloat parent_phase, int parent_teeth,
+                  int teeth, GLfloat direction)
+{
+   GLfloat parent_pitch = 360.0f / parent_teeth;
+   GLfloat pitch = 360.0f / teeth;
+   GLfloat parent_teeth_to_contact =
+      (direction - parent_phase - 0.375f * parent_pitch) / parent_pitch;
+   GLfloat phase = (direction + 180.0f - 0.375f * pitch -
+                    pitch * (0.5f - parent_teeth_to_contact));
+
+   return fmodf(phase, 360.0f);
+}
+
+/**
+ * Lays out a tree of meshing gears. Starting from the first gear, each
+ * gear gets children attached at random directions until there is no
+ * more room around it, so the scene grows outwards as a disc.
+ */
+static void
+create_random_scene(struct scene *scene, int n_gears,
+                    int min_teeth, int max_teeth)
+{
+   struct scene_grid grid;
+   struct gear_params params;
+   GLfloat color[4], direction, distance, x, y, phase, ratio;
+   GLfloat min_x = 0, max_x = 0, min_y = 0, max_y = 0, cx, cy;
+   const struct gear_params *parent_params;
+   uint32_t rng = 1;
+   int parent = 0, failures = 0, teeth;
+   int i;
+
+   scene_init(scene, n_gears);
+
+   /* The cells are big enough that only neighbouring cells can contain
+    * gears touching a gear */
+   grid.cell_size = 2.0f * (max_teeth * GEAR_MODULE + GEAR_TOOTH_DEPTH +
+                            GEAR_CLEARANCE);
+   for (grid.mask = 1; grid.mask < (uint32_t) n_gears * 2; grid.mask <<= 1);
+   grid.heads = xmalloc(grid.mask * sizeof *grid.heads);
+   memset(grid.heads, 0xff, grid.mask * sizeof *grid.heads);
+   grid.mask--;
+   grid.next = xmalloc(n_gears * sizeof *grid.next);
+
+   teeth = min_teeth + scene_random(&rng) % (max_teeth - min_teeth + 1);
+   make_gear_params(&params, teeth, &rng);
+   get_gear_color(0, color);
+   scene_add_gear(scene, &params, 0.0f, 0.0f, 0.0f, 1.0f, color);
+   grid_insert(&grid, scene, 0);
+
+   while (scene->n_gears < n_gears && parent < scene->n_gears) {
+      if (failures >= MAX_ATTACH_FAILURES) {
+         parent++;
+         failures = 0;
+         continue;
+      }
+
+      teeth = min_teeth + scene_random(&rng) % (max_teeth - min_teeth + 1);
+      make_gear_params(&params, teeth, &rng);
+
+      parent_params = &scene->meshes[scene->mesh[parent]].params;
+      direction = scene_random_float(&rng) * 360.0f;
+      distance = (parent_params->outer_radius + params.outer_radius +
+                  GEAR_CLEARANCE);
+      x = scene->x[parent] + distance * cosf(direction * M_PI / 180.0);
+      y = scene->y[parent] + distance * sinf(direction * M_PI / 180.0);
+
+      if (!grid_fits(&grid, scene, x, y,
+                     params.outer_radius + params.tooth_depth / 2.0f,
+                     parent)) {
+         failures++;
+         continue;
+      }
+
+      phase = get_meshing_phase(scene->phase[parent],
+                                parent_params->teeth,
+                                teeth,
+                                direction);
+      ratio = -scene->ratio[parent] * parent_params->teeth / teeth;
+      get_gear_color(scene->n_gears, color);
+
+      scene_add_gear(scene, &params, x, y, phase, ratio, color);
+      grid_insert(&grid, scene, scene->n_gears - 1);
+   }
+
+   free(grid.next);
+   free(grid.heads);
+
+   if (scene->n_gears < n_gears) {
+      fprintf(stderr, "only found room for %d of %d gears\n",
+              scene->n_gears, n_gears);
+   }
+
+   /* Move the center of the scene to the origin */
+   for (i = 0; i < scene->n_gears; i++) {
+      min_x = fminf(min_x, scene->x[i]);
+      max_x = fmaxf(max_x, scene->x[i]);
+      min_y = fminf(min_y, scene->y[i]);
+      max_y = fmaxf(max_y, scene->y[i]);
+   }
+
+   cx = (min_x + max_x) / 2.0f;
+   cy = (min_y + max_y) / 2.0f;
+
+   for (i = 0; i < scene->n_gears; i++) {
+      scene->x[i] -= cx;
+      scene->y[i] -= cy;
+   }
+}
+
+static int
+compare_gear_mesh(const void *a, const void *b, void *data)
+{
+   const int *mesh = data;
+   int ia = *(const int *) a, ib = *(const int *) b;
+
+   if (mesh[ia] != mesh[ib])
+      return mesh[ia] - mesh[ib];
+
+   return ia - ib;
+}
+
+#define PERMUTE_ARRAY(array, order, n) do {                     \
+      void *_tmp = xmalloc((n) * sizeof *(array));              \
+      int _i;                                                   \
+      for (_i = 0; _i < (n); _i++)                              \
+         memcpy((char *) _tmp + _i * sizeof *(array),           \
+                (array) + (order)[_i], sizeof *(array));        \
+      memcpy((array), _tmp, (n) * sizeof *(array));             \
+      free(_tmp);                                               \
+   } while (0)
+
+static int
+compare_gear_coord(const void *a, const void *b, void *data)
+{
+   const GLfloat *coord = data;
+   GLfloat ca = coord[*(const int *) a], cb = coord[*(const int *) b];
+
+   return (ca > cb) - (ca < cb);
+}
+
+/**
+ * Builds the node of the bounding volume hierarchy for a range of gears,
+ * and its children. The range is split in half along its longest side,
+ * which sorts the gears so that the gears in each node are consecutive.
+ *
+ * @param order the gears in the order being built
+ * @param first the start of the range in order
+ * @param count the number of gears in the range
+ * @param radius the bounding radius of each of the gears
+ *
+ * @return the index of the node
+ */
+static int
+build_bvh_node(struct scene *scene, int *order, int first, int count,
+               GLfloat radius)
+{
+   struct bvh_node *node;
+   GLfloat min_x, min_y, max_x, max_y, x, y, r;
+   int index = scene->n_nodes++;
+   int i, half;
+
+   min_x = min_y = HUGE_VALF;
+   max_x = max_y = -HUGE_VALF;
+
+   for (i = first; i < first + count; i++) {
+      min_x = fminf(min_x, scene->x[order[i]]);
+      max_x = fmaxf(max_x, scene->x[order[i]]);
+      min_y = fminf(min_y, scene->y[order[i]]);
+      max_y = fmaxf(max_y, scene->y[order[i]]);
+   }
+
+   x = (min_x + max_x) * 0.5f;
+   y = (min_y + max_y) * 0.5f;
+   r = 0.0f;
+
+   for (i = first; i < first + count; i++)
+      r = fmaxf(r, hypotf(scene->x[order[i]] - x, scene->y[order[i]] - y));
+
+   node = scene->nodes + index;
+   node->x = x;
+   node->y = y;
+   node->radius = r + radius;
+   node->first_gear = first;
+   node->n_gears = count;
+   node->right = 0;
+
+   if (count <= BVH_LEAF_SIZE)
+      return index;
+
+   qsort_r(order + first, count, sizeof *order, compare_gear_coord,
+           max_x - min_x > max_y - min_y ? scene->x : scene->y);
+
+   half = count / 2;
+   build_bvh_node(scene, order, first, half, radius);
+   i = build_bvh_node(scene, order, first + half, count - half, radius);
+   scene->nodes[index].right = i;
+
+   return index;
+}
+
+/**
+ * Builds a bounding volume hierarchy over the gears of each mesh and
+ * orders the gears to match. The gears only rotate in place so this is
+ * only done once.
+ */
+static void
+build_scene_bvh(struct scene *scene)
+{
+   struct gear_mesh *mesh;
+   struct timespec start, end;
+   int *order = xmalloc(scene->n_gears * sizeof *order);
+   GLfloat radius;
+   int i;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   for (i = 0; i < scene->n_gears; i++)
+      order[i] = i;
+
+   /* A binary tree with a gear or more per leaf has fewer than twice as
+    * many nodes as gears */
+   scene->nodes = arena_alloc(&scene->arena,
+                              2 * scene->n_gears * sizeof *scene->nodes);
+   scene->n_nodes = 0;
+
+   for (i = 0; i < scene->n_meshes; i++) {
+      mesh = scene->meshes + i;
+      radius = mesh->lods[GEAR_LOD_FULL]->bounding_radius;
+      mesh->bvh_root = build_bvh_node(scene, order, mesh->first_gear,
+                                      mesh->n_gears, radius);
+   }
+
+   PERMUTE_ARRAY(scene->x, order, scene->n_gears);
+   PERMUTE_ARRAY(scene->y, order, scene->n_gears);
+   PERMUTE_ARRAY(scene->phase, order, scene->n_gears);
+   PERMUTE_ARRAY(scene->ratio, order, scene->n_gears);
+   PERMUTE_ARRAY(scene->color, order, scene->n_gears);
+   PERMUTE_ARRAY(scene->mesh, order, scene->n_gears);
+
+   free(order);
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   printf("bvh: %d nodes built in %.3f ms\n", scene->n_nodes,
+          timespec_diff(&end, &start) * 1e3);
+}
+
+/**
+ * Sorts the gears by mesh so that consecutive gears share their vertex
+ * buffers, builds the hierarchy used for culling them and calculates the
+ * radius of the scene.
+ */
+static void
+finish_scene(struct scene *scene)
+{
+   int *order = xmalloc(scene->n_gears * sizeof *order);
+   struct gear_mesh *meshes;
+   GLfloat r;
+   int i;
+
+   /* The meshes were grown as the scene was laid out. Now that they are
+    * all there they go in the arena with the rest. */
+   meshes = arena_dup(&scene->arena, scene->meshes,
+                      scene->n_meshes * sizeof *scene->meshes);
+   free(scene->meshes);
+   scene->meshes = meshes;
+   scene->meshes_size = scene->n_meshes;
+
+   for (i = 0; i < scene->n_gears; i++)
+      order[i] = i;
+
+   qsort_r(order, scene->n_gears, sizeof *order,
+           compare_gear_mesh, scene->mesh);
+
+   PERMUTE_ARRAY(scene->x, order, scene->n_gears);
+   PERMUTE_ARRAY(scene->y, order, scene->n_gears);
+   PERMUTE_ARRAY(scene->phase, order, scene->n_gears);
+   PERMUTE_ARRAY(scene->ratio, order, scene->n_gears);
+   PERMUTE_ARRAY(scene->color, order, scene->n_gears);
+   PERMUTE_ARRAY(scene->mesh, order, scene->n_gears);
+
+   free(order);
+
+   for (i = 0; i < scene->n_meshes; i++)
+      scene->meshes[i].n_gears = 0;
+
+   for (i = scene->n_gears - 1; i >= 0; i--) {
+      scene->meshes[scene->mesh[i]].first_gear = i;
+      scene->meshes[scene->mesh[i]].n_gears++;
+   }
+
+   build_scene_bvh(scene);
+
+   scene->radius = 0.0f;
+
+   for (i = 0; i < scene->n_gears; i++) {
+      r = hypotf(scene->x[i], scene->y[i]) + get_tip_radius(scene, i);
+      if (r > scene->radius)
+         scene->radius = r;
+   }
+
+   printf("scene: %d gears, %d meshes, radius %.1f\n",
+          scene->n_gears, scene->n_meshes, scene->radius);
+}
+
+/**
+ * Moves the camera back far enough to see the whole scene as it spins
+ * and fits the depth range around it. The stereo parameters are scaled
+ * with the distance so that the depth effect looks the same. This needs
+ * the aspect ratio from gears_reshape().
+ */
+static void
+fit_camera(void)
+{
+   /* Half of the narrowest field of view. The frustum is 2 units wide
+    * and 2 * asp units high at the near plane. */
+   GLfloat half_fov = atanf(fminf(1.0f, asp));
+   GLfloat max_width = 0.0f;
+   int i;
+
+   for (i = 0; i < scene.n_meshes; i++)
+      max_width = fmaxf(max_width, scene.meshes[i].params.width);
+
+   view_distance = fmaxf(20.0f, scene.radius / sinf(half_fov)) / view_zoom;
+   eyesep = 0.5f * view_distance / 20.0f;
+   fix_point = 40.0f * view_distance / 20.0f;
+
+   near_plane = fmaxf(1.0f, view_distance - scene.radius - max_width);
+   far_plane = view_distance + scene.radius + max_width;
+}
+
+static void
+set_plane(GLfloat plane[4], GLfloat a, GLfloat b, GLfloat c, GLfloat d)
+{
+   GLfloat length = sqrtf(a * a + b * b + c * c);
+
+   plane[0] = a / length;
+   plane[1] = b / length;
+   plane[2] = c / length;
+   plane[3] = d / length;
+}
+
+/**
+ * Calculates the culling planes from the stereo frustum parameters. The
+ * eyes are offset along x, so they share the top, bottom, near and far
+ * planes. Their left and right planes cross, and the combined frustum
+ * uses the planes through the outermost edges of both frusta at the
+ * near and far planes, which contain both of them.
+ */
+static void
+update_cull_planes(void)
+{
+   /* Offset along x and slopes of the left and right sides of each
+    * eye's frustum, as in get_eye_view_projection() */
+   const GLfloat offset[2] = { -0.5f * eyesep, 0.5f * eyesep };
+   const GLfloat left_slope[2] = { left, -right };
+   const GLfloat right_slope[2] = { right, -left };
+   GLfloat min_near, min_far, max_near, max_far, slope;
+   int eye;
+
+   min_near = min_far = HUGE_VALF;
+   max_near = max_far = -HUGE_VALF;
+
+   for (eye = 0; eye < 2; eye++) {
+      /* The sides of the frustum at the depth d = -z are at
+       * x = offset + slope * d */
+      set_plane(eye_cull_planes[eye][0],
+                1.0f, 0.0f, left_slope[eye], -offset[eye]);
+      set_plane(eye_cull_planes[eye][1],
+                -1.0f, 0.0f, -right_slope[eye], offset[eye]);
+
+      min_near = fminf(min_near, offset[eye] + left_slope[eye] * near_plane);
+      min_far = fminf(min_far, offset[eye] + left_slope[eye] * far_plane);
+      max_near = fmaxf(max_near, offset[eye] + right_slope[eye] * near_plane);
+      max_far = fmaxf(max_far, offset[eye] + right_slope[eye] * far_plane);
+   }
+
+   slope = (min_far - min_near) / (far_plane - near_plane);
+   set_plane(cull_planes[0], 1.0f, 0.0f, slope,
+             slope * near_plane - min_near);
+   slope = (max_far - max_near) / (far_plane - near_plane);
+   set_plane(cull_planes[1], -1.0f, 0.0f, -slope,
+             max_near - slope * near_plane);
+   set_plane(cull_planes[2], 0.0f, 1.0f, -asp, 0.0f);
+   set_plane(cull_planes[3], 0.0f, -1.0f, -asp, 0.0f);
+   set_plane(cull_planes[4], 0.0f, 0.0f, -1.0f, -near_plane);
+   set_plane(cull_planes[5], 0.0f, 0.0f, 1.0f, far_plane);
+}
+
+/**
+ * Transforms the center of a gear or of a group of gears, which are on
+ * z = 0, to view space.
+ */
+static void
+get_view_center(const GLfloat *transform, GLfloat x, GLfloat y,
+                GLfloat center[3])
+{
+   center[0] = transform[0] * x + transform[4] * y + transform[12];
+   center[1] = transform[1] * x + transform[5] * y + transform[13];
+   center[2] = transform[2] * x + transform[6] * y + transform[14];
+}
+
+/* Results of testing a bounding sphere against some planes */
+enum cull_result {
+   CULL_OUTSIDE,
+   CULL_INTERSECTING,
+   CULL_INSIDE,
+};
+
+static enum cull_result
+classify_sphere(const GLfloat (*planes)[4], int n_planes,
+                const GLfloat center[3], GLfloat radius)
+{
+   enum cull_result result = CULL_INSIDE;
+   GLfloat distance;
+   int i;
+
+   for (i = 0; i < n_planes; i++) {
+      distance = (planes[i][0] * center[0] +
+                  planes[i][1] * center[1] +
+                  planes[i][2] * center[2] +
+                  planes[i][3]);
+      if (distance < -radius)
+         return CULL_OUTSIDE;
+      if (distance < radius)
+         result = CULL_INTERSECTING;
+   }
+
+   return result;
+}
+
+/**
+ * Adds gears to the visible ranges, merging them into the last range if
+ * they follow on from it with the same mesh.
+ */
+static void
+add_visible_range(int first_gear, int n_gears, unsigned int eyes)
+{
+   struct visible_range *range;
+   unsigned int drawn_eyes = eyes;
+   int eye;
+
+   /* Only drawing each gear for each eye separately can leave out one
+    * eye. Otherwise a gear is drawn for both if either can see it. */
+   if (draw_mode != DRAW_MODE_PER_GEAR || single_pass_stereo)
+      drawn_eyes = 3;
+
+   for (eye = 0; eye < 2; eye++) {
+      if (drawn_eyes & (1 << eye))
+         culled_gears[eye] -= n_gears;
+   }
+
+   if (n_visible_ranges > 0) {
+      range = visible_ranges + n_visible_ranges - 1;
+      if (range->eyes == eyes &&
+          range->first_gear + range->n_gears == first_gear &&
+          scene.mesh[range->first_gear] == scene.mesh[first_gear]) {
+         range->n_gears += n_gears;
+         return;
+      }
+   }
+
+   range = visible_ranges + n_visible_ranges++;
+   range->first_gear = first_gear;
+   range->n_gears = n_gears;
+   range->eyes = eyes;
+}
+
+/**
+ * Tests a bounding sphere once against the combined frustum of both eyes
+ * and then against the sides of each eye's frustum.
+ *
+ * @param transform the view transformation matrix
+ * @param x the x position of the center of the sphere
+ * @param y the y position of the center of the sphere
+ * @param radius the radius of the sphere
+ * @param eyes filled with the mask of the eyes that can see the sphere
+ *
+ * @return CULL_INSIDE if the sphere is entirely inside the frusta of the
+ *         eyes that can see it, otherwise CULL_INTERSECTING unless
+ *         neither eye can see it
+ */
+static enum cull_result
+cull_sphere(const GLfloat *transform, GLfloat x, GLfloat y, GLfloat radius,
+            unsigned int *eyes)
+{
+   enum cull_result result, eye_result;
+   GLfloat center[3];
+   int eye;
+
+   get_view_center(transform, x, y, center);
+
+   *eyes = 0;
+
+   result = classify_sphere(cull_planes, 6, center, radius);
+   if (result == CULL_OUTSIDE)
+      return CULL_OUTSIDE;
+
+   for (eye = 0; eye < 2; eye++) {
+      eye_result = classify_sphere(eye_cull_planes[eye], 2, center, radius);
+      if (eye_result != CULL_OUTSIDE)
+         *eyes |= 1 << eye;
+      if (eye_result == CULL_INTERSECTING)
+         result = CULL_INTERSECTING;
+   }
+
+   return *eyes ? result : CULL_OUTSIDE;
+}
+
+/**
+ * Culls the gears under a node of a bounding volume hierarchy. Nodes
+ * that are entirely inside or outside the frusta are handled without
+ * looking at their children, and the gears of leaves that cross the
+ * planes are tested individually.
+ */
+static void
+cull_bvh_node(const GLfloat *transform, const struct bvh_node *node,
+              GLfloat gear_radius)
+{
+   unsigned int eyes;
+   int i;
+
+   switch (cull_sphere(transform, node->x, node->y, node->radius, &eyes)) {
+   case CULL_OUTSIDE:
+      return;
+   case CULL_INSIDE:
+      add_visible_range(node->first_gear, node->n_gears, eyes);
+      return;
+   case CULL_INTERSECTING:
+      break;
+   }
+
+   if (node->right) {
+      cull_bvh_node(transform, node + 1, gear_radius);
+      cull_bvh_node(transform, scene.nodes + node->right, gear_radius);
+      return;
+   }
+
+   for (i = node->first_gear; i < node->first_gear + node->n_gears; i++) {
+      if (cull_sphere(transform, scene.x[i], scene.y[i], gear_radius,
+                      &eyes) != CULL_OUTSIDE)
+         add_visible_range(i, 1, eyes);
+   }
+}
+
+/**
+ * Works out which eyes can see the gears by walking the hierarchy of
+ * each mesh, and collects the visible gears into ranges.
+ *
+ * @param transform the view transformation matrix
+ */
+static void
+cull_gears(const GLfloat *transform)
+{
+   const struct gear_mesh *mesh;
+   struct timespec start, end;
+   int i;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   n_visible_ranges = 0;
+   /* The visible gears are subtracted as they are found */
+   culled_gears[0] += scene.n_gears;
+   culled_gears[1] += scene.n_gears;
+
+   for (i = 0; i < scene.n_meshes; i++) {
+      mesh = scene.meshes + i;
+      cull_bvh_node(transform, scene.nodes + mesh->bvh_root,
+                    mesh->lods[GEAR_LOD_FULL]->bounding_radius);
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   cull_time += timespec_diff(&end, &start);
+}
+
+/**
+ * Picks the level of detail for a projected radius, only moving away
+ * from the current one once the radius is clearly past a threshold.
+ */
+static int
+select_lod(int lod, GLfloat radius)
+{
+   while (lod > 0 &&
+          radius > lod_radius[lod - 1] * (1.0f + LOD_HYSTERESIS))
+      lod--;
+
+   while (lod < N_GEAR_LODS - 1 &&
+          radius < lod_radius[lod] * (1.0f - LOD_HYSTERESIS))
+      lod++;
+
+   return lod;
+}
+
+/**
+ * Updates the level of detail of the visible gears for each eye that can
+ * see them from their projected radius.
+ *
+ * @param transform the view transformation matrix
+ */
+static void
+select_gear_lods(const GLfloat *transform)
+{
+   const struct visible_range *range;
+   const struct gear *gear;
+   GLfloat center[3], dx, distance;
+   int i, j, eye;
+
+   for (i = 0; i < n_visible_ranges; i++) {
+      range = visible_ranges + i;
+
+      for (j = range->first_gear;
+           j < range->first_gear + range->n_gears;
+           j++) {
+         gear = scene.meshes[scene.mesh[j]].lods[GEAR_LOD_FULL];
+         get_view_center(transform, scene.x[j], scene.y[j], center);
+
+         for (eye = 0; eye < 2; eye++) {
+            if (!(range->eyes & (1 << eye)))
+               continue;
+
+            /* The eyes are offset along x as in
+             * get_eye_view_projection() */
+            dx = center[0] + (eye == 0 ? 0.5f : -0.5f) * eyesep;
+            distance = sqrtf(dx * dx +
+                             center[1] * center[1] +
+                             center[2] * center[2]);
+            gear_lods[j][eye] =
+               select_lod(gear_lods[j][eye],
+                          gear->bounding_radius * lod_scale[eye] / distance);
+         }
+      }
+   }
+}
+
+/**
+ * Gets the level of detail to draw a gear at for some eyes, which is the
+ * finest of their levels.
+ */
+static int
+get_gear_lod(const uint8_t lods[2], unsigned int eyes)
+{
+   if (eyes == 3)
+      return MIN(lods[0], lods[1]);
+
+   return lods[eyes == 1 ? 0 : 1];
+}
+
+/**
+ * Forgets the shadowed GL state. This has to be called whenever GL state
+ * is changed without going through the state_* functions.
+ */
+static void
+state_invalidate(void)
+{
+   gl_state.program = NULL;
+   gl_state.vertex_array = UNKNOWN_BINDING;
+   gl_state.array_buffer = UNKNOWN_BINDING;
+   gl_state.element_array_buffer = UNKNOWN_BINDING;
+   gl_state.attrib_gear = NULL;
+   gl_state.instance_gear = NULL;
+   gl_state.enabled_attribs = 0;
+   gl_state.viewport[2] = -1;
+
+   two_pass_program.n_uniforms = 0;
+   single_pass_program.n_uniforms = 0;
+}
+
+/**
+ * Records whether a state change is needed.
+ *
+ * @param needed whether the call would change anything
+ *
+ * @return needed
+ */
+static bool
+state_count(bool needed)
+{
+   if (needed)
+      gl_state.calls++;
+   else
+      gl_state.skipped_calls++;
+
+   return needed;
+}
+
+static void
+state_use_program(const struct gear_program *program)
+{
+   if (state_count(gl_state.program != program)) {
+      glUseProgram(program->program);
+      gl_state.program = program;
+   }
+}
+
+static void
+state_bind_vertex_array(GLuint vao)
+{
+   if (state_count(gl_state.vertex_array != vao)) {
+      BindVertexArray(vao);
+      gl_state.vertex_array = vao;
+      /* The element array buffer binding is part of the VAO */
+      gl_state.element_array_buffer = UNKNOWN_BINDING;
+      gl_state.attrib_gear = NULL;
+      gl_state.instance_gear = NULL;
+   }
+}
+
+static void
+state_bind_buffer(GLenum target, GLuint buffer)
+{
+   GLuint *binding = (target == GL_ARRAY_BUFFER ?
+                      &gl_state.array_buffer :
+                      &gl_state.element_array_buffer);
+
+   if (state_count(*binding != buffer)) {
+      glBindBuffer(target, buffer);
+      *binding = buffer;
+   }
+}
+
+static void
+state_enable_attrib(GLuint index)
+{
+   if (state_count(!(gl_state.enabled_attribs & (1 << index)))) {
+      glEnableVertexAttribArray(index);
+      gl_state.enabled_attribs |= 1 << index;
+   }
+}
+
+static void
+state_viewport(const GLint viewport[4])
+{
+   if (state_count(memcmp(gl_state.viewport, viewport,
+                          sizeof gl_state.viewport))) {
+      glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+      memcpy(gl_state.viewport, viewport, sizeof gl_state.viewport);
+   }
+}
+
+/**
+ * Checks whether a uniform of the current program already has a value
+ * and remembers the value otherwise.
+ *
+ * @return whether the value has to be uploaded
+ */
+static bool
+state_update_uniform(GLint location, GLsizei size, const GLfloat *value)
+{
+   struct gear_program *program = (struct gear_program *) gl_state.program;
+   struct cached_uniform *uniform = NULL;
+   int i;
+
+   for (i = 0; i < program->n_uniforms; i++) {
+      if (program->uniforms[i].location == location) {
+         uniform = program->uniforms + i;
+         break;
+      }
+   }
+
+   if (uniform == NULL) {
+      /* Don't cache anything if the cache is full or the value is too
+       * big, it will just always be uploaded */
+      if (program->n_uniforms >= MAX_CACHED_UNIFORMS ||
+          size > (GLsizei) (sizeof uniform->value / sizeof (GLfloat)))
+         return state_count(true);
+
+      uniform = program->uniforms + program->n_uniforms++;
+      uniform->location = location;
+      uniform->size = 0;
+   }
+
+   if (!state_count(uniform->size != size ||
+                    memcmp(uniform->value, value, size * sizeof *value)))
+      return false;
+
+   uniform->size = size;
+   memcpy(uniform->value, value, size * sizeof *value);
+
+   return true;
+}
+
+static void
+state_uniform_matrix4fv(GLint location, GLsizei count, const GLfloat *value)
+{
+   if (state_update_uniform(location, count * 16, value))
+      glUniformMatrix4fv(location, count, GL_FALSE, value);
+}
+
+static void
+state_uniform_matrix3fv(GLint location, GLsizei count, const GLfloat *value)
+{
+   if (state_update_uniform(location, count * 9, value))
+      glUniformMatrix3fv(location, count, GL_FALSE, value);
+}
+
+static void
+state_uniform1f(GLint location, GLfloat value)
+{
+   if (state_update_uniform(location, 1, &value))
+      glUniform1f(location, value);
+}
+
+static void
+state_uniform4fv(GLint location, GLsizei count, const GLfloat *value)
+{
+   if (state_update_uniform(location, count * 4, value))
+      glUniform4fv(location, count, value);
+}
+
+/**
+ * Sets up the vertex attributes to draw a gear, either by binding its
+ * VAO or by pointing the attributes at its buffers.
+ */
+static void
+bind_gear(const struct gear *gear)
+{
+   if (gear->vao) {
+      state_bind_vertex_array(gear->vao);
+      return;
+   }
+
+   if (state_count(gl_state.attrib_gear != gear)) {
+      state_bind_buffer(GL_ARRAY_BUFFER, gear->vbo);
+
+      /* Set up the position of the attributes in the vertex buffer
+       * object */
+      set_gear_attribs();
+
+      if (gear->batch_vbo) {
+         state_bind_buffer(GL_ARRAY_BUFFER, gear->batch_vbo);
+         glVertexAttribPointer(3, 1, GL_UNSIGNED_BYTE, GL_FALSE, 0, NULL);
+      }
+
+      gl_state.attrib_gear = gear;
+      gl_state.instance_gear = NULL;
+   }
+
+   state_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, gear->ibo);
+
+   /* The attributes are left enabled between draws */
+   state_enable_attrib(0);
+   state_enable_attrib(1);
+   if (gear->batch_vbo)
+      state_enable_attrib(3);
+
+   if (single_pass_stereo && state_count(!(gl_state.enabled_attribs & 4))) {
+      state_bind_buffer(GL_ARRAY_BUFFER, eye_vbo);
+      glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, NULL);
+      state_enable_attrib(2);
+      /* The gear's attributes still point into its own buffer */
+   }
+}
+
+/**
+ * Draws a gear.
+ *
+ * @param mesh the mesh of the gear
+ * @param transform the current transformation matrix
+ * @param x the x position to draw the gear at
+ * @param y the y position to draw the gear at
+ * @param angle the rotation angle of the gear
+ * @param color the color of the gear
+ * @param eyes bit mask of the eyes to draw the gear for
+ * @param lods the level of detail of the gear for each eye
+ */
+static void
+draw_gear(const struct gear_mesh *mesh, GLfloat * transform,
+          GLfloat x, GLfloat y, GLfloat angle, const GLfloat color[4],
+          unsigned int eyes, const uint8_t lods[2])
+{
+   const struct gear_program *program = gl_state.program;
+   const struct gear *gear;
+   GLfloat model_view[16];
+   GLfloat scaled_model_view[16];
+   GLfloat normal_matrix[9];
+   GLfloat model_view_projection[16];
+   int eye;
+
+   /* Translate and rotate the gear */
+   memcpy(model_view, transform, sizeof(model_view));
+   matrix_translate_rotate_z(model_view, x, y, 2 * M_PI * angle / 360.0);
+
+   /*
+    * Create and set the NormalMatrix. It's the inverse transpose of the
+    * ModelView matrix. The eyes only differ by a translation so this is
+    * the same for both of them. The shader normalizes the normals, so
+    * the scale of the mesh doesn't need to be included.
+    */
+   matrix_normal(normal_matrix, model_view);
+   state_uniform_matrix3fv(program->normal_matrix_location, 1,
+                           normal_matrix);
+
+   /* Set the gear color */
+   state_uniform4fv(program->color_location, 1, color);
+
+   if (single_pass_stereo) {
+      /* The eyes share the draw call, so it uses the finer of their
+       * levels of detail */
+      gear = mesh->lods[get_gear_lod(lods, eyes)];
+      bind_gear(gear);
+
+      /* Undo the normalization of the positions in the vertex buffer */
+      memcpy(scaled_model_view, model_view, sizeof(scaled_model_view));
+      matrix_scale(scaled_model_view, gear->scale, gear->scale, gear->scale);
+
+      /* The per-eye view and projection are applied in the shader */
+      state_uniform_matrix4fv(program->matrix_location, 1,
+                              scaled_model_view);
+
+      /* Draw all of the triangles that comprise the gear at once, with
+       * one instance per eye. The eyes share the draw call so both are
+       * drawn even if only one of them can see the gear. */
+      DrawElementsInstanced(GL_TRIANGLES, gear->nindices,
+                            GL_UNSIGNED_SHORT, NULL, 2);
+      draw_calls++;
+      drawn_triangles += 2 * gear->nindices / 3;
+      return;
+   }
+
+   for (eye = 0; eye < 2; eye++) {
+      if (!(eyes & (1 << eye)))
+         continue;
+
+      gear = mesh->lods[lods[eye]];
+      bind_gear(gear);
+
+      state_viewport(EyeViewport[eye]);
+
+      /* Create and set the ModelViewProjectionMatrix, undoing the
+       * normalization of the positions in the vertex buffer */
+      memcpy(scaled_model_view, model_view, sizeof(scaled_model_view));
+      matrix_scale(scaled_model_view, gear->scale, gear->scale, gear->scale);
+      matrix_multiply(model_view_projection,
+                      EyeViewProjectionMatrix[eye], scaled_model_view);
+      state_uniform_matrix4fv(program->matrix_location, 1,
+                              model_view_projection);
+
+      /* Draw all of the triangles that comprise the gear at once */
+      glDrawElements(GL_TRIANGLES, gear->nindices, GL_UNSIGNED_SHORT, NULL);
+      draw_calls++;
+      drawn_triangles += gear->nindices / 3;
+   }
+}
+
+/**
+ * Points the instance attributes at the part of the instance buffer
+ * with the instances of a gear, which has to be bound.
+ */
+static void
+set_instance_attribs(const struct gear *gear)
+{
+   const GLfloat *transforms = NULL;
+   const GLfloat *colors = transforms + 4 * N_GEAR_LODS * scene.n_gears;
+
+   glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+                         transforms + 4 * gear->first_instance);
+   glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+                         colors + 4 * gear->first_instance);
+}
+
+/**
+ * Sets up the vertex attributes to draw the instances of a gear.
+ */
+static void
+bind_gear_instances(const struct gear *gear)
+{
+   bind_gear(gear);
+
+   if (gear->vao)
+      return;
+
+   if (state_count(gl_state.instance_gear != gear)) {
+      state_bind_buffer(GL_ARRAY_BUFFER, instance_vbo);
+      set_instance_attribs(gear);
+      gl_state.instance_gear = gear;
+   }
+
+   state_enable_attrib(3);
+   state_enable_attrib(4);
+}
+
+/**
+ * Calculates the transform of every visible gear for the current angle
+ * and packs them together with their colors into the instances of the
+ * mesh at the gear's level of detail. The eyes share the instances, so
+ * each gear uses the finer of the levels of the eyes that can see it.
+ */
+static void
+update_instances(void)
+{
+   const struct visible_range *range;
+   struct gear_mesh *mesh;
+   GLfloat a;
+   int i, j, lod, n;
+
+   for (i = 0; i < scene.n_meshes; i++) {
+      for (lod = 0; lod < N_GEAR_LODS; lod++)
+         scene.meshes[i].n_visible[lod] = 0;
+   }
+
+   for (i = 0; i < n_visible_ranges; i++) {
+      range = visible_ranges + i;
+
+      for (j = range->first_gear;
+           j < range->first_gear + range->n_gears;
+           j++) {
+         mesh = scene.meshes + scene.mesh[j];
+         lod = get_gear_lod(gear_lods[j], range->eyes);
+         n = mesh->lods[lod]->first_instance + mesh->n_visible[lod]++;
+
+         a = fmod(scene.ratio[j] * angle, 360.0) + scene.phase[j];
+         instance_transforms[n][0] = scene.x[j];
+         instance_transforms[n][1] = scene.y[j];
+         sincosf(a * M_PI / 180.0, &instance_transforms[n][3],
+                 &instance_transforms[n][2]);
+         memcpy(instance_colors[n], scene.color[j], sizeof instance_colors[n]);
+      }
+   }
+}
+
+/**
+ * Draws all of the visible gears with one instanced draw call per mesh
+ * and level of detail, and per eye unless both eyes are drawn in a
+ * single pass. The eyes share the instance buffer, so a gear is drawn
+ * for both eyes if either of them can see it.
+ *
+ * @param transform the view transformation matrix
+ */
+static void
+draw_instanced(const GLfloat *transform)
+{
+   const struct gear_program *program = gl_state.program;
+   GLsizeiptr size = N_GEAR_LODS * scene.n_gears *
+      sizeof *instance_transforms;
+   GLsizeiptr offset, count;
+   GLfloat normal_matrix[9];
+   GLfloat model_view_projection[16];
+   const struct gear_mesh *mesh;
+   const struct gear *gear;
+   int eye, i, lod, first;
+
+   /* Replace the contents of the instance buffer without waiting for
+    * the GPU to finish with the previous frame's, and only upload the
+    * parts that are used */
+   state_bind_buffer(GL_ARRAY_BUFFER, instance_vbo);
+   glBufferData(GL_ARRAY_BUFFER, size * 2, NULL, GL_STREAM_DRAW);
+
+   for (i = 0; i < scene.n_meshes; i++) {
+      mesh = scene.meshes + i;
+
+      for (lod = 0; lod < N_GEAR_LODS; lod++) {
+         if (mesh->n_visible[lod] == 0)
+            continue;
+
+         first = mesh->lods[lod]->first_instance;
+         offset = first * sizeof *instance_transforms;
+         count = mesh->n_visible[lod] * sizeof *instance_transforms;
+         glBufferSubData(GL_ARRAY_BUFFER, offset, count,
+                         instance_transforms[first]);
+         glBufferSubData(GL_ARRAY_BUFFER, size + offset, count,
+                         instance_colors[first]);
+      }
+   }
+
+   /* The gears are rotated around Z in the shader, which doesn't
+    * affect the normal matrix of the view */
+   matrix_normal(normal_matrix, transform);
+   state_uniform_matrix3fv(program->normal_matrix_location, 1,
+                           normal_matrix);
+
+   for (eye = 0; eye < 2; eye++) {
+      if (single_pass_stereo) {
+         state_uniform_matrix4fv(program->matrix_location, 1, transform);
+      } else {
+         state_viewport(EyeViewport[eye]);
+
+         matrix_multiply(model_view_projection,
+                         EyeViewProjectionMatrix[eye], transform);
+         state_uniform_matrix4fv(program->matrix_location, 1,
+                                 model_view_projection);
+      }
+
+      for (i = 0; i < scene.n_meshes; i++) {
+         mesh = scene.meshes + i;
+
+         for (lod = 0; lod < N_GEAR_LODS; lod++) {
+            if (mesh->n_visible[lod] == 0)
+               continue;
+
+            gear = mesh->lods[lod];
+            bind_gear_instances(gear);
+            state_uniform1f(program->scale_location, gear->scale);
+
+            /* With single-pass stereo each gear has an instance for
+             * each eye */
+            count = mesh->n_visible[lod] * (single_pass_stereo ? 2 : 1);
+            DrawElementsInstanced(GL_TRIANGLES, gear->nindices,
+                                  GL_UNSIGNED_SHORT, NULL, count);
+            draw_calls++;
+            drawn_triangles += count * gear->nindices / 3;
+         }
+      }
+
+      if (single_pass_stereo)
+         break;
+   }
+}
+
+/**
+ * Draws the visible gears in batches using the copies of the meshes,
+ * with the transforms and colors of the gears in uniform arrays. Like
+ * with instancing, the eyes share the batches.
+ *
+ * @param transform the view transformation matrix
+ */
+static void
+draw_batched(const GLfloat *transform)
+{
+   const struct gear_program *program = gl_state.program;
+   GLfloat normal_matrix[9];
+   GLfloat model_view_projection[2][16];
+   const struct gear_mesh *mesh;
+   const struct gear *gear;
+   int eye, i, lod, first, end, count;
+
+   matrix_normal(normal_matrix, transform);
+   state_uniform_matrix3fv(program->normal_matrix_location, 1,
+                           normal_matrix);
+
+   for (eye = 0; eye < 2; eye++) {
+      matrix_multiply(model_view_projection[eye],
+                      EyeViewProjectionMatrix[eye], transform);
+   }
+
+   for (i = 0; i < scene.n_meshes; i++) {
+      mesh = scene.meshes + i;
+
+      for (lod = 0; lod < N_GEAR_LODS; lod++) {
+         if (mesh->n_visible[lod] == 0)
+            continue;
+
+         gear = mesh->lods[lod];
+         bind_gear(gear);
+         state_uniform1f(program->scale_location, gear->scale);
+
+         end = gear->first_instance + mesh->n_visible[lod];
+
+         for (first = gear->first_instance; first < end; first += count) {
+            count = MIN(gear->batch_size, end - first);
+
+            state_uniform4fv(program->instance_transform_location, count,
+                             instance_transforms[first]);
+            state_uniform4fv(program->instance_color_location, count,
+                             instance_colors[first]);
+
+            /* The batch uniforms are big so both eyes are drawn before
+             * moving on to the next batch */
+            for (eye = 0; eye < 2; eye++) {
+               state_viewport(EyeViewport[eye]);
+               state_uniform_matrix4fv(program->matrix_location, 1,
+                                       model_view_projection[eye]);
+               glDrawElements(GL_TRIANGLES, count * gear->nindices,
+                              GL_UNSIGNED_SHORT, NULL);
+               draw_calls++;
+               drawn_triangles += count * gear->nindices / 3;
+            }
+         }
+      }
+   }
+}
+
+/**
+ * Draws the gears.
+ */
+static void
+gears_draw(void)
+{
+   const struct visible_range *range;
+   GLfloat transform[16];
+   uint64_t start;
+   int i, j;
+
+   matrix_identity(transform);
+
+   /* Translate and rotate the view */
+   matrix_translate(transform, 0, 0, -view_distance);
+   matrix_rotate(transform, 2 * M_PI * view_rot[0] / 360.0, 1, 0, 0);
+   matrix_rotate(transform, 2 * M_PI * view_rot[1] / 360.0, 0, 1, 0);
+   matrix_rotate(transform, 2 * M_PI * view_rot[2] / 360.0, 0, 0, 1);
+
+   start = get_time_ns();
+
+   cull_gears(transform);
+
+   if (lod_enabled)
+      select_gear_lods(transform);
+
+   end_stage(STAGE_CULL, start);
+
+   if (draw_mode != DRAW_MODE_PER_GEAR) {
+      update_instances();
+
+      if (draw_mode == DRAW_MODE_INSTANCED)
+         draw_instanced(transform);
+      else
+         draw_batched(transform);
+
+      return;
+   }
+
+   /* Draw the gears */
+   for (i = 0; i < n_visible_ranges; i++) {
+      range = visible_ranges + i;
+
+      for (j = range->first_gear;
+           j < range->first_gear + range->n_gears;
+           j++) {
+         draw_gear(scene.meshes + scene.mesh[j], transform,
+                   scene.x[j], scene.y[j],
+                   fmod(scene.ratio[j] * angle, 360.0) + scene.phase[j],
+                   scene.color[j], range->eyes, gear_lods[j]);
+      }
+   }
+}
+
+static void
+get_eye_rect(const struct stereo_renderer *renderer, int eye,
+             GLint rect[4])
+{
+   rect[0] = eye == 0 ? 0 : renderer->layout.right_eye_x;
+   rect[1] = eye == 0 ? renderer->layout.left_eye_y : 0;
+   rect[2] = renderer->layout.eye_width;
+   rect[3] = renderer->layout.eye_height;
+}
+
+/**
+ * Calculates the projection times the view matrix of an eye.
+ *
+ * @param eye 0 for the left eye or 1 for the right eye
+ * @param m filled with the matrix
+ */
+static void
+get_eye_view_projection(int eye, GLfloat *m)
+{
+   GLfloat view_matrix[16];
+
+   if (eye == 0)
+      matrix_frustum(m,
+                     left * near_plane, right * near_plane,
+                     -asp * near_plane, asp * near_plane,
+                     near_plane, far_plane);
+   else
+      matrix_frustum(m,
+                     -right * near_plane, -left * near_plane,
+                     -asp * near_plane, asp * near_plane,
+                     near_plane, far_plane);
+
+   matrix_identity(view_matrix);
+   matrix_translate(view_matrix, (eye == 0 ? 0.5 : -0.5) * eyesep, 0.0, 0.0);
+   matrix_multiply(m, m, view_matrix);
+}
+
+/**
+ * Sets up drawing both eyes at once. The gears are drawn with one
+ * instance per eye into a viewport covering the whole buffer, and the
+ * shader squashes the clip-space position of each instance into its
+ * eye's rectangle.
+ */
+static void
+setup_single_pass(struct stereo_renderer *renderer)
+{
+   const struct mode_layout *layout = &renderer->layout;
+   const GLint viewport[4] = {
+      0, 0, layout->buffer_width, layout->buffer_height
+   };
+   GLfloat eye_remap[2][4];
+   GLint *rect;
+   int eye;
+
+   state_viewport(viewport);
+
+   for (eye = 0; eye < 2; eye++) {
+      /* Scale and offset that map the eye's normalized device
+       * coordinates to its rectangle within the buffer */
+      rect = EyeViewport[eye];
+      eye_remap[eye][0] = (GLfloat) rect[2] / layout->buffer_width;
+      eye_remap[eye][1] = (GLfloat) rect[3] / layout->buffer_height;
+      eye_remap[eye][2] =
+         (2.0f * rect[0] + rect[2]) / layout->buffer_width - 1.0f;
+      eye_remap[eye][3] =
+         (2.0f * rect[1] + rect[3]) / layout->buffer_height - 1.0f;
+   }
+
+   state_uniform_matrix4fv(single_pass_program.eye_view_projection_location,
+                           2, &EyeViewProjectionMatrix[0][0]);
+   state_uniform4fv(single_pass_program.eye_remap_location,
+                    2, &eye_remap[0][0]);
+}
+
+static void
+redraw(struct stereo_renderer *renderer)
+{
+   uint64_t start = get_time_ns(), ns;
+   int eye;
+
+   glClearColor(0.0, 0.0, 0.0, 1.0);
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+   for (eye = 0; eye < 2; eye++) {
+      get_eye_rect(renderer, eye, EyeViewport[eye]);
+      get_eye_view_projection(eye, EyeViewProjectionMatrix[eye]);
+
+      /* The frustum of each eye is right - left wide and 2 * asp high
+       * at a distance of 1 */
+      lod_scale[eye] = fminf(EyeViewport[eye][2] / (right - left),
+                             EyeViewport[eye][3] / (2.0f * asp));
+   }
+
+   if (single_pass_stereo) {
+      state_use_program(&single_pass_program);
+      setup_single_pass(renderer);
+   } else {
+      /* Each gear is drawn for the left eye and then the right eye */
+      state_use_program(&two_pass_program);
+   }
+
+   gears_draw();
+
+   ns = get_time_ns() - start;
+   redraw_ns += ns;
+   record_stage(STAGE_REDRAW, ns);
+}
+
+/**
+ * Handles a new window size or exposure.
+ *
+ * @param width the window width
+ * @param height the window height
+ */
+static void
+gears_reshape(int width, int height)
+{
+   GLfloat w;
+
+   asp = (GLfloat) height / (GLfloat) width;
+   fit_camera();
+
+   w = fix_point * (1.0 / 5.0);
+
+   left = -5.0 * ((w - 0.5 * eyesep) / fix_point);
+   right = 5.0 * ((w + 0.5 * eyesep) / fix_point);
 
-   return v + 1;
+   update_cull_planes();
 }
 
 /**
- *  Create a gear wheel.
- *
- *  @param inner_radius radius of hole at center
- *  @param outer_radius radius at center of teeth
- *  @param width width of gear
- *  @param teeth number of teeth
- *  @param tooth_depth depth of tooth
+ * Advances the animation to the time that the next frame is going to be
+ * displayed and reports the frame rate.
  *
- *  @return pointer to the constructed struct gear
+ * @param present_ns the predicted CLOCK_MONOTONIC time in nanoseconds at
+ *                   which the frame will be scanned out
  */
-static struct gear *
-create_gear(GLfloat inner_radius, GLfloat outer_radius,
-            GLfloat width, GLint teeth, GLfloat tooth_depth)
+static void
+gears_idle(uint64_t present_ns)
 {
-   GLfloat r0, r1, r2;
-   GLfloat da;
-   GearVertex *v;
-   struct gear *gear;
-   double s[5], c[5];
-   GLfloat normal[3];
-   int cur_strip = 0;
-   int i;
+   static int frames = 0;
+   static uint64_t last_present_ns = 0, rate_start_ns = 0;
+   uint64_t now = get_time_ns();
+   double dt = 0.0;
+
+   /* A prediction that turned out too late mustn't make the gears turn
+    * back */
+   if (last_present_ns == 0)
+      last_present_ns = present_ns;
+   if (present_ns > last_present_ns) {
+      dt = (present_ns - last_present_ns) / 1e9;
+      last_present_ns = present_ns;
+   }
 
-   /* Allocate memory for the gear */
-   gear = malloc(sizeof *gear);
-   if (gear == NULL)
-      return NULL;
+   /* advance rotation for next frame */
+   angle += 70.0 * dt;     /* 70 degrees per second */
 
-   /* Calculate the radii used in the gear */
-   r0 = inner_radius;
-   r1 = outer_radius - tooth_depth / 2.0;
-   r2 = outer_radius + tooth_depth / 2.0;
+   view_rot[1] = fmod(angle / 2.0, 360.0);
 
-   da = 2.0 * M_PI / teeth / 4.0;
+   frames++;
 
-   /* Allocate memory for the triangle strip information */
-   gear->nstrips = STRIPS_PER_TOOTH * teeth;
-   gear->strips = calloc(gear->nstrips, sizeof(*gear->strips));
+   if (rate_start_ns == 0)
+      rate_start_ns = now;
+   if (now - rate_start_ns >= UINT64_C(5000000000)) {
+      GLfloat seconds = (now - rate_start_ns) / 1e9;
+      GLfloat fps = frames / seconds;
+      printf("%d frames in %3.1f seconds = %6.3f FPS "
+             "(%.1f draw calls, %.1fk triangles, %.1f GL state calls, "
+             "%.1f redundant calls skipped, %.1f/%.1f of %d gears "
+             "culled for the left/right eye in %.1f us, %.1f us CPU "
+             "per redraw)\n",
+             frames,
+             seconds, fps,
+             (double) draw_calls / frames,
+             drawn_triangles / 1e3 / frames,
+             (double) gl_state.calls / frames,
+             (double) gl_state.skipped_calls / frames,
+             (double) culled_gears[0] / frames,
+             (double) culled_gears[1] / frames,
+             scene.n_gears,
+             cull_time * 1e6 / frames,
+             redraw_ns / 1e3 / frames);
+      rate_start_ns = now;
+      frames = 0;
+      draw_calls = 0;
+      drawn_triangles = 0;
+      gl_state.calls = 0;
+      gl_state.skipped_calls = 0;
+      culled_gears[0] = culled_gears[1] = 0;
+      cull_time = 0.0;
+      redraw_ns = 0;
+   }
+}
 
-   /* Allocate memory for the vertices */
-   gear->vertices =
-      calloc(VERTICES_PER_TOOTH * teeth, sizeof(*gear->vertices));
-   v = gear->vertices;
+static const char vertex_shader[] =
+   "attribute vec3 position;\n"
+   "attribute vec3 normal;\n"
+   "\n"
+   "uniform mat4 ModelViewProjectionMatrix;\n"
+   "uniform mat3 NormalMatrix;\n"
+   "uniform vec4 LightSourcePosition;\n"
+   "uniform vec4 MaterialColor;\n"
+   "\n"
+   "varying vec4 Color;\n"
+   "\n"
+   "void main(void)\n"
+   "{\n"
+   "    // Transform the normal to eye coordinates\n"
+   "    vec3 N = normalize(NormalMatrix * normal);\n"
+   "\n"
+   "    // The LightSourcePosition is actually its direction\n"
+   "    // for directional light\n"
+   "    vec3 L = normalize(LightSourcePosition.xyz);\n"
+   "\n"
+   "    // Multiply the diffuse value by the vertex color (which is\n"
+   "    // fixed in this case) to get the actual color that we will\n"
+   "    // use to draw this vertex with\n"
+   "    float diffuse = max(dot(N, L), 0.0);\n"
+   "    Color = vec4(diffuse * MaterialColor.rgb, 1.0);\n"
+   "\n"
+   "    // Transform the position to clip coordinates\n"
+   "    gl_Position = ModelViewProjectionMatrix * vec4(position, 1.0);\n"
+   "}";
 
-   for (i = 0; i < teeth; i++) {
-      /* Calculate needed sin/cos for varius angles */
-      sincos(i * 2.0 * M_PI / teeth, &s[0], &c[0]);
-      sincos(i * 2.0 * M_PI / teeth + da, &s[1], &c[1]);
-      sincos(i * 2.0 * M_PI / teeth + da * 2, &s[2], &c[2]);
-      sincos(i * 2.0 * M_PI / teeth + da * 3, &s[3], &c[3]);
-      sincos(i * 2.0 * M_PI / teeth + da * 4, &s[4], &c[4]);
+static const char fragment_shader[] =
+   "precision mediump float;\n"
+   "varying vec4 Color;\n"
+   "\n"
+   "void main(void)\n"
+   "{\n"
+   "    gl_FragColor = Color;\n"
+   "}";
 
-      /* A set of macros for making the creation of the
-       * gears easier */
-#define  GEAR_POINT(r, da) { (r) * c[(da)], (r) * s[(da)] }
-#define  SET_NORMAL(x, y, z) do {                               \
-         normal[0] = (x); normal[1] = (y); normal[2] = (z);     \
-      } while(0)
+static const char single_pass_vertex_shader[] =
+   "attribute vec3 position;\n"
+   "attribute vec3 normal;\n"
+   "attribute float eye;\n"
+   "\n"
+   "uniform mat4 EyeViewProjectionMatrix[2];\n"
+   "uniform vec4 EyeRemap[2];\n"
+   "uniform mat4 ModelMatrix;\n"
+   "uniform mat3 NormalMatrix;\n"
+   "uniform vec4 LightSourcePosition;\n"
+   "uniform vec4 MaterialColor;\n"
+   "\n"
+   "varying vec4 Color;\n"
+   "varying vec3 EyeClip;\n"
+   "\n"
+   "void main(void)\n"
+   "{\n"
+   "    // The eyes only differ by a translation so the lighting is\n"
+   "    // the same as for the two-pass shader\n"
+   "    vec3 N = normalize(NormalMatrix * normal);\n"
+   "    vec3 L = normalize(LightSourcePosition.xyz);\n"
+   "    float diffuse = max(dot(N, L), 0.0);\n"
+   "    Color = vec4(diffuse * MaterialColor.rgb, 1.0);\n"
+   "\n"
+   "    // Transform to the clip coordinates of this instance's eye\n"
+   "    int e = int(eye);\n"
+   "    vec4 pos = EyeViewProjectionMatrix[e] *\n"
+   "               (ModelMatrix * vec4(position, 1.0));\n"
+   "\n"
+   "    // Keep the unmapped position so that the fragment shader can\n"
+   "    // clip against the eye's frustum\n"
+   "    EyeClip = pos.xyw;\n"
+   "\n"
+   "    // Squash the eye's clip space into its part of the buffer\n"
+   "    gl_Position = vec4(pos.xy * EyeRemap[e].xy +\n"
+   "                       pos.w * EyeRemap[e].zw,\n"
+   "                       pos.zw);\n"
+   "}";
 
-#define  GEAR_VERT(v, point, sign)                                      \
-      vert((v), p[(point)].x, p[(point)].y, (sign) * width * 0.5, normal)
+static const char single_pass_fragment_shader[] =
+   "precision mediump float;\n"
+   "varying vec4 Color;\n"
+   "varying vec3 EyeClip;\n"
+   "\n"
+   "void main(void)\n"
+   "{\n"
+   "    // Don't let a triangle spill into the other eye\n"
+   "    if (any(greaterThan(abs(EyeClip.xy), vec2(EyeClip.z))))\n"
+   "        discard;\n"
+   "    gl_FragColor = Color;\n"
+   "}";
 
-#define START_STRIP do {                                        \
-         gear->strips[cur_strip].first = v - gear->vertices;    \
-      } while(0);
+static const char instanced_vertex_shader[] =
+   "attribute vec3 position;\n"
+   "attribute vec3 normal;\n"
+   "\n"
+   "#ifdef BATCHED\n"
+   "attribute float instance;\n"
+   "uniform vec4 InstanceTransform[BATCH_SIZE];\n"
+   "uniform vec4 InstanceColor[BATCH_SIZE];\n"
+   "#else\n"
+   "// The position of the gear and the cosine and sine of its angle\n"
+   "attribute vec4 instance_transform;\n"
+   "attribute vec4 instance_color;\n"
+   "#endif\n"
+   "\n"
+   "#ifdef SINGLE_PASS\n"
+   "attribute float eye;\n"
+   "uniform mat4 EyeViewProjectionMatrix[2];\n"
+   "uniform vec4 EyeRemap[2];\n"
+   "uniform mat4 ModelMatrix;\n"
+   "varying vec3 EyeClip;\n"
+   "#else\n"
+   "uniform mat4 ModelViewProjectionMatrix;\n"
+   "#endif\n"
+   "\n"
+   "uniform mat3 NormalMatrix;\n"
+   "uniform float Scale;\n"
+   "uniform vec4 LightSourcePosition;\n"
+   "\n"
+   "varying vec4 Color;\n"
+   "\n"
+   "void main(void)\n"
+   "{\n"
+   "#ifdef BATCHED\n"
+   "    vec4 transform = InstanceTransform[int(instance)];\n"
+   "    vec4 material = InstanceColor[int(instance)];\n"
+   "#else\n"
+   "    vec4 transform = instance_transform;\n"
+   "    vec4 material = instance_color;\n"
+   "#endif\n"
+   "\n"
+   "    // Rotate the gear around Z and move it into place\n"
+   "    mat2 rotation = mat2(transform.z, transform.w,\n"
+   "                         -transform.w, transform.z);\n"
+   "    vec4 p = vec4(rotation * (position.xy * Scale) + transform.xy,\n"
+   "                  position.z * Scale, 1.0);\n"
+   "\n"
+   "    vec3 N = normalize(NormalMatrix *\n"
+   "                       vec3(rotation * normal.xy, normal.z));\n"
+   "    vec3 L = normalize(LightSourcePosition.xyz);\n"
+   "    float diffuse = max(dot(N, L), 0.0);\n"
+   "    Color = vec4(diffuse * material.rgb, 1.0);\n"
+   "\n"
+   "#ifdef SINGLE_PASS\n"
+   "    int e = int(eye);\n"
+   "    vec4 pos = EyeViewProjectionMatrix[e] * (ModelMatrix * p);\n"
+   "    EyeClip = pos.xyw;\n"
+   "    gl_Position = vec4(pos.xy * EyeRemap[e].xy +\n"
+   "                       pos.w * EyeRemap[e].zw,\n"
+   "                       pos.zw);\n"
+   "#else\n"
+   "    gl_Position = ModelViewProjectionMatrix * p;\n"
+   "#endif\n"
+   "}";
 
-#define END_STRIP do {                          \
-         int _tmp = (v - gear->vertices);       \
-         gear->strips[cur_strip].count = _tmp - \
-            gear->strips[cur_strip].first;      \
-         cur_strip++;                           \
-      } while (0)
+/**
+ * Compiles and links a program for drawing the gears.
+ *
+ * @param program filled with the program and its uniform locations
+ * @param defines preprocessor definitions prepended to the vertex
+ *                shader, or NULL
+ * @param vertex_source the vertex shader
+ * @param fragment_source the fragment shader
+ */
+static void
+create_program(struct gear_program *program,
+               const char *defines,
+               const char *vertex_source,
+               const char *fragment_source)
+{
+   GLuint v, f;
+   const char *p;
+   const char *sources[2];
+   char msg[512];
 
-#define QUAD_WITH_NORMAL(p1, p2) do {                   \
-         SET_NORMAL((p[(p1)].y - p[(p2)].y),            \
-                    -(p[(p1)].x - p[(p2)].x), 0);       \
-         v = GEAR_VERT(v, (p1), -1);                    \
-         v = GEAR_VERT(v, (p1), 1);                     \
-         v = GEAR_VERT(v, (p2), -1);                    \
-         v = GEAR_VERT(v, (p2), 1);                     \
-      } while(0)
+   /* Compile the vertex shader */
+   sources[0] = defines ? defines : "";
+   sources[1] = vertex_source;
+   v = glCreateShader(GL_VERTEX_SHADER);
+   glShaderSource(v, 2, sources, NULL);
+   glCompileShader(v);
+   glGetShaderInfoLog(v, sizeof msg, NULL, msg);
+   printf("vertex shader info: %s\n", msg);
 
-      struct point {
-         GLfloat x;
-         GLfloat y;
-      };
+   /* Compile the fragment shader */
+   p = fragment_source;
+   f = glCreateShader(GL_FRAGMENT_SHADER);
+   glShaderSource(f, 1, &p, NULL);
+   glCompileShader(f);
+   glGetShaderInfoLog(f, sizeof msg, NULL, msg);
+   printf("fragment shader info: %s\n", msg);
 
-      /* Create the 7 points (only x,y coords) used to draw a tooth */
-      struct point p[7] = {
-         GEAR_POINT(r2, 1),      // 0
-         GEAR_POINT(r2, 2),      // 1
-         GEAR_POINT(r1, 0),      // 2
-         GEAR_POINT(r1, 3),      // 3
-         GEAR_POINT(r0, 0),      // 4
-         GEAR_POINT(r1, 4),      // 5
-         GEAR_POINT(r0, 4),      // 6
-      };
+   /* Create and link the shader program */
+   program->program = glCreateProgram();
+   glAttachShader(program->program, v);
+   glAttachShader(program->program, f);
+   glBindAttribLocation(program->program, 0, "position");
+   glBindAttribLocation(program->program, 1, "normal");
+   glBindAttribLocation(program->program, 2, "eye");
+   glBindAttribLocation(program->program, 3, "instance_transform");
+   glBindAttribLocation(program->program, 3, "instance");
+   glBindAttribLocation(program->program, 4, "instance_color");
+
+   glLinkProgram(program->program);
+
+   /* The shaders go away with the program */
+   glDeleteShader(v);
+   glDeleteShader(f);
+   glGetProgramInfoLog(program->program, sizeof msg, NULL, msg);
+   printf("info: %s\n", msg);
 
-      /* Front face */
-      START_STRIP;
-      SET_NORMAL(0, 0, 1.0);
-      v = GEAR_VERT(v, 0, +1);
-      v = GEAR_VERT(v, 1, +1);
-      v = GEAR_VERT(v, 2, +1);
-      v = GEAR_VERT(v, 3, +1);
-      v = GEAR_VERT(v, 4, +1);
-      v = GEAR_VERT(v, 5, +1);
-      v = GEAR_VERT(v, 6, +1);
-      END_STRIP;
+   /* Get the locations of the uniforms so we can access them */
+   program->matrix_location =
+      glGetUniformLocation(program->program, "ModelViewProjectionMatrix");
+   if (program->matrix_location == -1)
+      program->matrix_location =
+         glGetUniformLocation(program->program, "ModelMatrix");
+   program->normal_matrix_location =
+      glGetUniformLocation(program->program, "NormalMatrix");
+   program->light_location =
+      glGetUniformLocation(program->program, "LightSourcePosition");
+   program->color_location =
+      glGetUniformLocation(program->program, "MaterialColor");
+   program->eye_view_projection_location =
+      glGetUniformLocation(program->program, "EyeViewProjectionMatrix");
+   program->eye_remap_location =
+      glGetUniformLocation(program->program, "EyeRemap");
+   program->scale_location =
+      glGetUniformLocation(program->program, "Scale");
+   program->instance_transform_location =
+      glGetUniformLocation(program->program, "InstanceTransform");
+   program->instance_color_location =
+      glGetUniformLocation(program->program, "InstanceColor");
 
-      /* Inner face */
-      START_STRIP;
-      QUAD_WITH_NORMAL(4, 6);
-      END_STRIP;
+   /* Set the LightSourcePosition uniform which is constant
+    * throught the program */
+   glUseProgram(program->program);
+   glUniform4fv(program->light_location, 1, LightSourcePosition);
+}
 
-      /* Back face */
-      START_STRIP;
-      SET_NORMAL(0, 0, -1.0);
-      v = GEAR_VERT(v, 6, -1);
-      v = GEAR_VERT(v, 5, -1);
-      v = GEAR_VERT(v, 4, -1);
-      v = GEAR_VERT(v, 3, -1);
-      v = GEAR_VERT(v, 2, -1);
-      v = GEAR_VERT(v, 1, -1);
-      v = GEAR_VERT(v, 0, -1);
-      END_STRIP;
+/**
+ * Checks whether the context is OpenGL ES 3.0 or later.
+ */
+static bool
+is_gles3(void)
+{
+   const char *version = (const char *) glGetString(GL_VERSION);
 
-      /* Outer face */
-      START_STRIP;
-      QUAD_WITH_NORMAL(0, 2);
-      END_STRIP;
+   return (version && strncmp(version, "OpenGL ES ", 10) == 0 &&
+           atoi(version + 10) >= 3);
+}
 
-      START_STRIP;
-      QUAD_WITH_NORMAL(1, 0);
-      END_STRIP;
+/**
+ * Looks up the instanced drawing functions from ES 3 or one of the
+ * instanced arrays extensions.
+ *
+ * @return whether instanced drawing is available
+ */
+static bool
+init_instancing(void)
+{
+   const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+   const char *suffix;
+   char name[64];
+
+   if (DrawElementsInstanced)
+      return true;
+
+   if (is_gles3())
+      suffix = "";
+   else if (has_extension(extensions, "GL_ANGLE_instanced_arrays"))
+      suffix = "ANGLE";
+   else if (has_extension(extensions, "GL_EXT_instanced_arrays"))
+      suffix = "EXT";
+   else
+      return false;
 
-      START_STRIP;
-      QUAD_WITH_NORMAL(3, 1);
-      END_STRIP;
+   snprintf(name, sizeof name, "glDrawElementsInstanced%s", suffix);
+   DrawElementsInstanced = (PFNGLDRAWELEMENTSINSTANCEDEXTPROC)
+      eglGetProcAddress(name);
+   snprintf(name, sizeof name, "glVertexAttribDivisor%s", suffix);
+   VertexAttribDivisor = (PFNGLVERTEXATTRIBDIVISOREXTPROC)
+      eglGetProcAddress(name);
 
-      START_STRIP;
-      QUAD_WITH_NORMAL(5, 3);
-      END_STRIP;
+   if (DrawElementsInstanced == NULL || VertexAttribDivisor == NULL) {
+      DrawElementsInstanced = NULL;
+      VertexAttribDivisor = NULL;
+      return false;
    }
 
-   gear->nvertices = (v - gear->vertices);
-
-   /* Store the vertices in a vertex buffer object (VBO) */
-   glGenBuffers(1, &gear->vbo);
-   glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
-   glBufferData(GL_ARRAY_BUFFER, gear->nvertices * sizeof(GearVertex),
-                gear->vertices, GL_STATIC_DRAW);
-
-   return gear;
+   return true;
 }
 
-/**
- * Multiplies two 4x4 matrices.
- *
- * The result is stored in matrix m.
- *
- * @param m the first matrix to multiply
- * @param n the second matrix to multiply
- */
 static void
-multiply(GLfloat * m, const GLfloat * n)
+init_single_pass_stereo(void)
 {
-   GLfloat tmp[16];
-   const GLfloat *row, *column;
-   div_t d;
-   int i, j;
+   static const GLfloat eyes[2] = { 0.0f, 1.0f };
 
-   for (i = 0; i < 16; i++) {
-      tmp[i] = 0;
-      d = div(i, 4);
-      row = n + d.quot * 4;
-      column = m + d.rem;
-      for (j = 0; j < 4; j++)
-         tmp[i] += row[j] * column[j * 4];
+   if (!init_instancing()) {
+      fprintf(stderr, "instanced drawing is not supported, "
+              "drawing the eyes in two passes\n");
+      single_pass_stereo = false;
+      return;
    }
-   memcpy(m, &tmp, sizeof tmp);
-}
 
-/**
- * Rotates a 4x4 matrix.
- *
- * @param[in,out] m the matrix to rotate
- * @param angle the angle to rotate
- * @param x the x component of the direction to rotate to
- * @param y the y component of the direction to rotate to
- * @param z the z component of the direction to rotate to
- */
-static void
-rotate(GLfloat * m, GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
-{
-   double s, c;
-
-   sincos(angle, &s, &c);
-   GLfloat r[16] = {
-      x * x * (1 - c) + c, y * x * (1 - c) + z * s,
-      x * z * (1 - c) - y * s, 0,
-      x * y * (1 - c) - z * s, y * y * (1 - c) + c,
-      y * z * (1 - c) + x * s, 0,
-      x * z * (1 - c) + y * s, y * z * (1 - c) - x * s,
-      z * z * (1 - c) + c, 0,
-      0, 0, 0, 1
-   };
+   if (draw_mode == DRAW_MODE_PER_GEAR) {
+      create_program(&single_pass_program, NULL,
+                     single_pass_vertex_shader,
+                     single_pass_fragment_shader);
+   } else {
+      create_program(&single_pass_program, "#define SINGLE_PASS\n",
+                     instanced_vertex_shader,
+                     single_pass_fragment_shader);
+   }
 
-   multiply(m, r);
+   glGenBuffers(1, &eye_vbo);
+   glBindBuffer(GL_ARRAY_BUFFER, eye_vbo);
+   glBufferData(GL_ARRAY_BUFFER, sizeof eyes, eyes, GL_STATIC_DRAW);
+   /* This is also set in every VAO */
+   VertexAttribDivisor(2, 1);
 }
 
 /**
- * Translates a 4x4 matrix.
- *
- * @param[in,out] m the matrix to translate
- * @param x the x component of the direction to translate to
- * @param y the y component of the direction to translate to
- * @param z the z component of the direction to translate to
+ * Looks up the vertex array object functions from ES 3 or
+ * GL_OES_vertex_array_object.
  */
 static void
-translate(GLfloat * m, GLfloat x, GLfloat y, GLfloat z)
+init_vertex_arrays(void)
 {
-   GLfloat t[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, x, y, z, 1 };
-
-   multiply(m, t);
+   const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+   const char *suffix;
+   char name[64];
+
+   if (is_gles3())
+      suffix = "";
+   else if (has_extension(extensions, "GL_OES_vertex_array_object"))
+      suffix = "OES";
+   else
+      return;
+
+   snprintf(name, sizeof name, "glGenVertexArrays%s", suffix);
+   GenVertexArrays = (PFNGLGENVERTEXARRAYSOESPROC) eglGetProcAddress(name);
+   snprintf(name, sizeof name, "glBindVertexArray%s", suffix);
+   BindVertexArray = (PFNGLBINDVERTEXARRAYOESPROC) eglGetProcAddress(name);
+   snprintf(name, sizeof name, "glDeleteVertexArrays%s", suffix);
+   DeleteVertexArrays =
+      (PFNGLDELETEVERTEXARRAYSOESPROC) eglGetProcAddress(name);
+
+   if (!GenVertexArrays || !BindVertexArray || !DeleteVertexArrays) {
+      GenVertexArrays = NULL;
+      BindVertexArray = NULL;
+      DeleteVertexArrays = NULL;
+   }
 }
 
 /**
- * Creates an identity 4x4 matrix.
+ * Picks the most compact vertex format that the driver supports.
  *
- * @param m the matrix make an identity matrix
+ * @param force_float whether to use float vertices regardless
  */
 static void
-identity(GLfloat * m)
+init_vertex_format(bool force_float)
 {
-   GLfloat t[16] = {
-      1.0, 0.0, 0.0, 0.0,
-      0.0, 1.0, 0.0, 0.0,
-      0.0, 0.0, 1.0, 0.0,
-      0.0, 0.0, 0.0, 1.0,
-   };
+   const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+   const char *name;
+
+   if (force_float) {
+      vertex_format = VERTEX_FORMAT_FLOAT;
+      name = "float";
+   } else if (is_gles3()) {
+      vertex_format = VERTEX_FORMAT_SHORT_PACKED;
+      packed_normal_type = GL_INT_2_10_10_10_REV;
+      name = "short positions, 2_10_10_10_REV normals";
+   } else if (has_extension(extensions, "GL_OES_vertex_type_10_10_10_2")) {
+      vertex_format = VERTEX_FORMAT_SHORT_PACKED;
+      packed_normal_type = GL_INT_10_10_10_2_OES;
+      name = "short positions, 10_10_10_2 normals";
+   } else {
+      vertex_format = VERTEX_FORMAT_SHORT_BYTE;
+      name = "short positions, byte normals";
+   }
 
-   memcpy(m, t, sizeof(t));
+   printf("vertex format: %s (%zu bytes per vertex)\n", name,
+          get_vertex_size());
 }
 
 /**
- * Transposes a 4x4 matrix.
+ * Picks how to submit the gears. Instancing is preferred, then batching
+ * with uniform arrays.
  *
- * @param m the matrix to transpose
+ * @param per_gear whether to draw each gear separately regardless
  */
 static void
-transpose(GLfloat * m)
+init_draw_mode(bool per_gear)
+{
+   GLint max_vectors;
+   const char *name;
+
+   if (per_gear) {
+      draw_mode = DRAW_MODE_PER_GEAR;
+      name = "a draw call per gear";
+   } else if (init_instancing()) {
+      draw_mode = DRAW_MODE_INSTANCED;
+      name = "instanced draw calls per mesh";
+   } else {
+      /* Leave room for the other uniforms and two vectors per gear */
+      glGetIntegerv(GL_MAX_VERTEX_UNIFORM_VECTORS, &max_vectors);
+      batch_size = MIN((max_vectors - 16) / 2, MAX_BATCH_SIZE);
+
+      if (batch_size < 2) {
+         batch_size = 1;
+         draw_mode = DRAW_MODE_PER_GEAR;
+         name = "a draw call per gear";
+      } else {
+         draw_mode = DRAW_MODE_BATCHED;
+         name = "batches of gears in uniform arrays";
+      }
+   }
+
+   printf("drawing with %s\n", name);
+}
+
+static void
+create_two_pass_program(void)
 {
-   GLfloat t[16] = {
-      m[0], m[4], m[8], m[12],
-      m[1], m[5], m[9], m[13],
-      m[2], m[6], m[10], m[14],
-      m[3], m[7], m[11], m[15]
-   };
+   char defines[64];
 
-   memcpy(m, t, sizeof(t));
+   switch (draw_mode) {
+   case DRAW_MODE_PER_GEAR:
+      create_program(&two_pass_program, NULL,
+                     vertex_shader, fragment_shader);
+      break;
+   case DRAW_MODE_INSTANCED:
+      create_program(&two_pass_program, NULL,
+                     instanced_vertex_shader, fragment_shader);
+      break;
+   case DRAW_MODE_BATCHED:
+      snprintf(defines, sizeof defines,
+               "#define BATCHED\n#define BATCH_SIZE %d\n", batch_size);
+      create_program(&two_pass_program, defines,
+                     instanced_vertex_shader, fragment_shader);
+      break;
+   }
 }
 
 /**
- * Inverts a 4x4 matrix.
- *
- * This function can currently handle only pure translation-rotation matrices.
- * Read http://www.gamedev.net/community/forums/topic.asp?topic_id=425118
- * for an explanation.
+ * Creates the buffers for the per-gear data once the scene is known.
  */
 static void
-invert(GLfloat * m)
+init_instances(void)
 {
-   GLfloat t[16];
-   identity(t);
+   const struct gear_mesh *mesh;
+   struct gear *gear;
+   GLfloat *eyes;
+   int n_instances = N_GEAR_LODS * scene.n_gears;
+   int max_gears = 0, divisor, i, lod;
+
+   /* Each level of detail has room for all of the gears, and the
+    * instances of each mesh are at the same place within it */
+   for (i = 0; i < scene.n_meshes; i++) {
+      mesh = scene.meshes + i;
+      for (lod = 0; lod < N_GEAR_LODS; lod++) {
+         mesh->lods[lod]->first_instance =
+            lod * scene.n_gears + mesh->first_gear;
+      }
+   }
 
-   // Extract and invert the translation part 't'. The inverse of a
-   // translation matrix can be calculated by negating the translation
-   // coordinates.
-   t[12] = -m[12];
-   t[13] = -m[13];
-   t[14] = -m[14];
+   instance_transforms = arena_alloc(&scene.arena,
+                                     n_instances *
+                                     sizeof *instance_transforms);
+   instance_colors = arena_alloc(&scene.arena,
+                                 n_instances * sizeof *instance_colors);
 
-   // Invert the rotation part 'r'. The inverse of a rotation matrix is
-   // equal to its transpose.
-   m[12] = m[13] = m[14] = 0;
-   transpose(m);
+   if (draw_mode != DRAW_MODE_INSTANCED)
+      return;
 
-   // inv(m) = inv(r) * inv(t)
-   multiply(m, t);
-}
+   glGenBuffers(1, &instance_vbo);
+   glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+   glBufferData(GL_ARRAY_BUFFER,
+                n_instances * 2 * sizeof *instance_transforms,
+                NULL, GL_STREAM_DRAW);
 
-static void
-frustum(GLfloat *m,
-        float left,
-        float right,
-        float bottom,
-        float top,
-        float nearval,
-        float farval)
-{
-   float x, y, a, b, c, d;
+   /* With single-pass stereo every gear has an instance for each eye */
+   divisor = single_pass_stereo ? 2 : 1;
+
+   for (i = 0; i < scene.n_meshes; i++) {
+      mesh = scene.meshes + i;
+      max_gears = MAX(max_gears, mesh->n_gears);
+
+      for (lod = 0; lod < N_GEAR_LODS; lod++) {
+         gear = mesh->lods[lod];
+         if (gear->vao == 0)
+            continue;
+
+         BindVertexArray(gear->vao);
+         set_instance_attribs(gear);
+         VertexAttribDivisor(3, divisor);
+         VertexAttribDivisor(4, divisor);
+         glEnableVertexAttribArray(3);
+         glEnableVertexAttribArray(4);
+         BindVertexArray(0);
+      }
+   }
 
-   x = (2.0f * nearval) / (right - left);
-   y = (2.0f * nearval) / (top - bottom);
-   a = (right + left) / (right - left);
-   b = (top + bottom) / (top - bottom);
-   c = -(farval + nearval) / ( farval - nearval);
-   d = -(2.0f * farval * nearval) / (farval - nearval);  /* error? */
+   /* For drawing without VAOs */
+   VertexAttribDivisor(3, divisor);
+   VertexAttribDivisor(4, divisor);
 
-#define M(row,col)  m[col*4+row]
-   M (0,0) = x;     M (0,1) = 0.0f;  M (0,2) = a;      M (0,3) = 0.0f;
-   M (1,0) = 0.0f;  M (1,1) = y;     M (1,2) = b;      M (1,3) = 0.0f;
-   M (2,0) = 0.0f;  M (2,1) = 0.0f;  M (2,2) = c;      M (2,3) = d;
-   M (3,0) = 0.0f;  M (3,1) = 0.0f;  M (3,2) = -1.0f;  M (3,3) = 0.0f;
-#undef M
+   if (single_pass_stereo) {
+      /* The eye alternates between the instances */
+      eyes = xmalloc(max_gears * 2 * sizeof *eyes);
+      for (i = 0; i < max_gears * 2; i++)
+         eyes[i] = i & 1;
+
+      glBindBuffer(GL_ARRAY_BUFFER, eye_vbo);
+      glBufferData(GL_ARRAY_BUFFER, max_gears * 2 * sizeof *eyes,
+                   eyes, GL_STATIC_DRAW);
+      free(eyes);
+   }
 }
 
-/**
- * Draws a gear.
- *
- * @param gear the gear to draw
- * @param transform the current transformation matrix
- * @param x the x position to draw the gear at
- * @param y the y position to draw the gear at
- * @param angle the rotation angle of the gear
- * @param color the color of the gear
- */
 static void
-draw_gear(struct gear *gear, GLfloat * transform,
-          GLfloat x, GLfloat y, GLfloat angle, const GLfloat color[4])
+gears_init(const struct stereo_options *options)
 {
-   GLfloat model_view[16];
-   GLfloat normal_matrix[16];
-   GLfloat model_view_projection[16];
+   glEnable(GL_CULL_FACE);
+   glEnable(GL_DEPTH_TEST);
 
-   /* Translate and rotate the gear */
-   memcpy(model_view, transform, sizeof(model_view));
-   translate(model_view, x, y, 0);
-   rotate(model_view, 2 * M_PI * angle / 360.0, 0, 0, 1);
+   init_vertex_arrays();
+   init_vertex_format(options->float_vertices);
 
-   /* Create and set the ModelViewProjectionMatrix */
-   memcpy(model_view_projection, ProjectionMatrix,
-          sizeof(model_view_projection));
-   multiply(model_view_projection, model_view);
+   init_draw_mode(options->per_gear_draws);
 
-   glUniformMatrix4fv(ModelViewProjectionMatrix_location, 1, GL_FALSE,
-                      model_view_projection);
+   view_zoom = options->zoom;
 
-   /*
-    * Create and set the NormalMatrix. It's the inverse transpose of the
-    * ModelView matrix.
-    */
-   memcpy(normal_matrix, model_view, sizeof(normal_matrix));
-   invert(normal_matrix);
-   transpose(normal_matrix);
-   glUniformMatrix4fv(NormalMatrix_location, 1, GL_FALSE, normal_matrix);
+   if (single_pass_stereo)
+      init_single_pass_stereo();
 
-   /* Set the gear color */
-   glUniform4fv(MaterialColor_location, 1, color);
+   create_two_pass_program();
 
-   /* Set the vertex buffer object to use */
-   glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
+   /* make the gears */
+   if (options->n_gears > 0) {
+      create_random_scene(&scene, options->n_gears,
+                          options->min_teeth, options->max_teeth);
+   } else {
+      create_classic_scene(&scene);
+   }
 
-   /* Set up the position of the attributes in the vertex buffer object */
-   glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
-                         6 * sizeof(GLfloat), NULL);
-   glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
-                         6 * sizeof(GLfloat), (GLfloat *) 0 + 3);
+   create_scene_meshes(&scene, options);
+   finish_scene(&scene);
 
-   /* Enable the attributes */
-   glEnableVertexAttribArray(0);
-   glEnableVertexAttribArray(1);
+   visible_ranges = arena_alloc(&scene.arena,
+                                scene.n_gears * sizeof *visible_ranges);
+
+   /* The gears start at full detail */
+   lod_enabled = !options->full_detail;
+   gear_lods = arena_alloc(&scene.arena, scene.n_gears * sizeof *gear_lods);
+   memset(gear_lods, GEAR_LOD_FULL, scene.n_gears * sizeof *gear_lods);
 
-   /* Draw the triangle strips that comprise the gear */
-   int n;
-   for (n = 0; n < gear->nstrips; n++)
-      glDrawArrays(GL_TRIANGLE_STRIP, gear->strips[n].first,
-                   gear->strips[n].count);
+   if (draw_mode != DRAW_MODE_PER_GEAR)
+      init_instances();
 
-   /* Disable the attributes */
-   glDisableVertexAttribArray(1);
-   glDisableVertexAttribArray(0);
+   printf("memory: %zu KiB of scene data in %d blocks of %zu KiB\n",
+          scene.arena.used / 1024, scene.arena.n_blocks,
+          scene.arena.reserved / 1024);
+
+   /* Everything from here on goes through the state cache */
+   state_invalidate();
 }
 
 /**
- * Draws the gears.
+ * Deletes the GL objects of the scene and frees all of its memory at
+ * once. The GL context must still be current.
  */
 static void
-gears_draw(const GLfloat *view_matrix)
+gears_fini(void)
 {
-   static const GLfloat red[4] = { 0.8, 0.1, 0.0, 1.0 };
-   static const GLfloat green[4] = { 0.0, 0.8, 0.2, 1.0 };
-   static const GLfloat blue[4] = { 0.2, 0.2, 1.0, 1.0 };
-   GLfloat transform[16];
+   struct gear *gear;
+   int i, lod;
 
-   memcpy(transform, view_matrix, sizeof(transform));
+   for (i = 0; i < scene.n_meshes; i++) {
+      for (lod = 0; lod < N_GEAR_LODS; lod++) {
+         gear = scene.meshes[i].lods[lod];
+         if (gear == NULL)
+            continue;
 
-   /* Translate and rotate the view */
-   translate(transform, 0, 0, -20);
-   rotate(transform, 2 * M_PI * view_rot[0] / 360.0, 1, 0, 0);
-   rotate(transform, 2 * M_PI * view_rot[1] / 360.0, 0, 1, 0);
-   rotate(transform, 2 * M_PI * view_rot[2] / 360.0, 0, 0, 1);
+         glDeleteBuffers(1, &gear->vbo);
+         glDeleteBuffers(1, &gear->ibo);
+         glDeleteBuffers(1, &gear->batch_vbo);
+         if (gear->vao)
+            DeleteVertexArrays(1, &gear->vao);
+      }
+   }
 
-   /* Draw the gears */
-   draw_gear(gear1, transform, -3.0, -2.0, angle, red);
-   draw_gear(gear2, transform, 3.1, -2.0, -2 * angle - 9.0, green);
-   draw_gear(gear3, transform, -3.1, 4.2, -2 * angle - 25.0, blue);
-}
+   glDeleteBuffers(1, &instance_vbo);
+   glDeleteBuffers(1, &eye_vbo);
+   instance_vbo = eye_vbo = 0;
 
-static void
-set_eye(struct stereo_renderer *renderer, int eye)
-{
-   if (eye == 0) {
-      glViewport(0, renderer->layout.left_eye_y,
-                 renderer->layout.eye_width,
-                 renderer->layout.eye_height);
-   } else {
-      glViewport(renderer->layout.right_eye_x, 0,
-                 renderer->layout.eye_width,
-                 renderer->layout.eye_height);
-   }
+   glDeleteProgram(two_pass_program.program);
+   glDeleteProgram(single_pass_program.program);
+   two_pass_program.program = single_pass_program.program = 0;
+
+   arena_fini(&scene.geometry);
+   arena_fini(&scene.arena);
+   memset(&scene, 0, sizeof scene);
 }
 
 static void
-redraw(struct stereo_renderer *renderer)
+draw(struct stereo_renderer *renderer, uint64_t present_ns)
 {
-   GLfloat view_matrix[16];
+   uint64_t start = get_time_ns();
 
-   glClearColor(0.0, 0.0, 0.0, 1.0);
-   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+   gears_idle(present_ns);
+   end_stage(STAGE_IDLE, start);
 
-   /* First left eye.  */
-   set_eye(renderer, 0);
+   redraw(renderer);
+}
+
+static struct stereo_renderer *
+create_renderer(const struct mode_layout *layout,
+                const struct stereo_options *options)
+{
+   struct stereo_renderer *renderer;
 
-   frustum(ProjectionMatrix, left, right, -asp, asp, 1.0, 1024.0);
+   renderer = xmalloc(sizeof *renderer);
+   memset(renderer, 0, sizeof *renderer);
 
-   identity(view_matrix);
-   translate(view_matrix, +0.5 * eyesep, 0.0, 0.0);
-   gears_draw(view_matrix);
+   renderer->layout = *layout;
 
-   /* Then right eye.  */
-   set_eye(renderer, 1);
+   single_pass_stereo = options->single_pass_stereo;
 
-   frustum(ProjectionMatrix, -right, -left, -asp, asp, 1.0, 1024.0);
+   gears_init(options);
+   gears_reshape(layout->virtual_eye_width, layout->virtual_eye_height);
 
-   identity(view_matrix);
-   translate(view_matrix, -0.5 * eyesep, 0.0, 0.0);
-   gears_draw(view_matrix);
+   return renderer;
 }
 
-/**
- * Handles a new window size or exposure.
- *
- * @param width the window width
- * @param height the window height
- */
 static void
-gears_reshape(int width, int height)
+renderer_free(struct stereo_renderer *renderer)
 {
-   GLfloat w;
+   gears_fini();
+   free(renderer);
+}
 
-   asp = (GLfloat) height / (GLfloat) width;
-   w = fix_point * (1.0 / 5.0);
+static int
+event_loop_init(struct event_loop *loop)
+{
+   loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (loop->epoll_fd == -1) {
+      fprintf(stderr, "error creating epoll fd: %m\n");
+      return -errno;
+   }
 
-   left = -5.0 * ((w - 0.5 * eyesep) / fix_point);
-   right = 5.0 * ((w + 0.5 * eyesep) / fix_point);
+   return 0;
 }
 
-static int
-get_elapsed_time(void)
+static void
+event_loop_fini(struct event_loop *loop)
 {
-   static int start_time = 0;
-   int now;
-   struct timeval tv;
+   close(loop->epoll_fd);
+}
 
-   gettimeofday(&tv, NULL);
+/**
+ * Starts watching a file descriptor. func is called from
+ * event_loop_dispatch() whenever one of the events is ready.
+ */
+static int
+event_loop_add_fd(struct event_loop *loop,
+                  struct event_source *source,
+                  int fd,
+                  uint32_t events,
+                  event_source_func func,
+                  void *data)
+{
+   struct epoll_event ev = {
+      .events = events,
+      .data.ptr = source,
+   };
 
-   now = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+   source->fd = fd;
+   source->func = func;
+   source->data = data;
 
-   if (start_time == 0) {
-      start_time = now;
-      return 0;
-   } else {
-      return now - start_time;
+   if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+      fprintf(stderr, "error adding fd to event loop: %m\n");
+      return -errno;
    }
+
+   return 0;
 }
 
+/**
+ * Waits for at most timeout milliseconds (-1 to wait forever) and
+ * dispatches the sources that are ready.
+ *
+ * @param wake_ns if not NULL, set to the get_time_ns() when the wait
+ *                ended, before any of the sources were dispatched
+ */
 static void
-gears_idle(void)
+event_loop_dispatch(struct event_loop *loop, int timeout, uint64_t *wake_ns)
 {
-   static int frames = 0;
-   static double tRot0 = -1.0, tRate0 = -1.0;
-   double dt, t = get_elapsed_time() / 1000.0;
-
-   if (tRot0 < 0.0)
-      tRot0 = t;
-   dt = t - tRot0;
-   tRot0 = t;
+   struct epoll_event events[8];
+   struct event_source *source;
+   int i, n;
 
-   /* advance rotation for next frame */
-   angle += 70.0 * dt;     /* 70 degrees per second */
-   if (angle > 3600.0)
-      angle -= 3600.0;
+   n = epoll_wait(loop->epoll_fd,
+                  events, sizeof events / sizeof events[0],
+                  timeout);
 
-   view_rot[1] = angle / 2.0f;
+   if (wake_ns)
+      *wake_ns = get_time_ns();
 
-   frames++;
+   if (n == -1 && errno != EINTR)
+      fprintf(stderr, "epoll_wait failed: %m\n");
 
-   if (tRate0 < 0.0)
-      tRate0 = t;
-   if (t - tRate0 >= 5.0) {
-      GLfloat seconds = t - tRate0;
-      GLfloat fps = frames / seconds;
-      printf("%d frames in %3.1f seconds = %6.3f FPS\n", frames,
-             seconds, fps);
-      tRate0 = t;
-      frames = 0;
+   for (i = 0; i < n; i++) {
+      source = events[i].data.ptr;
+      source->func(source, events[i].events);
    }
 }
 
-static const char vertex_shader[] =
-   "attribute vec3 position;\n"
-   "attribute vec3 normal;\n"
-   "\n"
-   "uniform mat4 ModelViewProjectionMatrix;\n"
-   "uniform mat4 NormalMatrix;\n"
-   "uniform vec4 LightSourcePosition;\n"
-   "uniform vec4 MaterialColor;\n"
-   "\n"
-   "varying vec4 Color;\n"
-   "\n"
-   "void main(void)\n"
-   "{\n"
-   "    // Transform the normal to eye coordinates\n"
-   "    vec3 N = normalize(vec3(NormalMatrix * vec4(normal, 1.0)));\n"
-   "\n"
-   "    // The LightSourcePosition is actually its direction\n"
-   "    // for directional light\n"
-   "    vec3 L = normalize(LightSourcePosition.xyz);\n"
-   "\n"
-   "    // Multiply the diffuse value by the vertex color (which is\n"
-   "    // fixed in this case) to get the actual color that we will\n"
-   "    // use to draw this vertex with\n"
-   "    float diffuse = max(dot(N, L), 0.0);\n"
-   "    Color = vec4(diffuse * MaterialColor.rgb, 1.0);\n"
-   "\n"
-   "    // Transform the position to clip coordinates\n"
-   "    gl_Position = ModelViewProjectionMatrix * vec4(position, 1.0);\n"
-   "}";
-
-static const char fragment_shader[] =
-   "precision mediump float;\n"
-   "varying vec4 Color;\n"
-   "\n"
-   "void main(void)\n"
-   "{\n"
-   "    gl_FragColor = Color;\n"
-   "}";
-
 static void
-gears_init(void)
+drm_source_cb(struct event_source *source, uint32_t events)
 {
-   GLuint v, f, program;
-   const char *p;
-   char msg[512];
-
-   glEnable(GL_CULL_FACE);
-   glEnable(GL_DEPTH_TEST);
-
-   /* Compile the vertex shader */
-   p = vertex_shader;
-   v = glCreateShader(GL_VERTEX_SHADER);
-   glShaderSource(v, 1, &p, NULL);
-   glCompileShader(v);
-   glGetShaderInfoLog(v, sizeof msg, NULL, msg);
-   printf("vertex shader info: %s\n", msg);
-
-   /* Compile the fragment shader */
-   p = fragment_shader;
-   f = glCreateShader(GL_FRAGMENT_SHADER);
-   glShaderSource(f, 1, &p, NULL);
-   glCompileShader(f);
-   glGetShaderInfoLog(f, sizeof msg, NULL, msg);
-   printf("fragment shader info: %s\n", msg);
+   struct stereo_data *data = source->data;
 
-   /* Create and link the shader program */
-   program = glCreateProgram();
-   glAttachShader(program, v);
-   glAttachShader(program, f);
-   glBindAttribLocation(program, 0, "position");
-   glBindAttribLocation(program, 1, "normal");
-
-   glLinkProgram(program);
-   glGetProgramInfoLog(program, sizeof msg, NULL, msg);
-   printf("info: %s\n", msg);
+   UNUSED(events);
 
-   /* Enable the shaders */
-   glUseProgram(program);
+   winsys_dispatch(data->winsys);
+}
 
-   /* Get the locations of the uniforms so we can access them */
-   ModelViewProjectionMatrix_location =
-      glGetUniformLocation(program, "ModelViewProjectionMatrix");
-   NormalMatrix_location = glGetUniformLocation(program, "NormalMatrix");
-   LightSourcePosition_location =
-      glGetUniformLocation(program, "LightSourcePosition");
-   MaterialColor_location = glGetUniformLocation(program, "MaterialColor");
+static void
+signal_source_cb(struct event_source *source, uint32_t events)
+{
+   struct stereo_data *data = source->data;
+   struct signalfd_siginfo info;
 
-   /* Set the LightSourcePosition uniform which is constant
-    * throught the program */
-   glUniform4fv(LightSourcePosition_location, 1, LightSourcePosition);
+   UNUSED(events);
 
-   /* make the gears */
-   gear1 = create_gear(1.0, 4.0, 1.0, 20, 0.7);
-   gear2 = create_gear(0.5, 2.0, 2.0, 10, 0.7);
-   gear3 = create_gear(1.3, 2.0, 0.5, 10, 0.7);
+   if (read(source->fd, &info, sizeof info) == sizeof info)
+      data->quit = true;
 }
 
 static void
-draw(struct stereo_renderer *renderer)
+stats_source_cb(struct event_source *source, uint32_t events)
 {
-   gears_idle();
-   redraw(renderer);
+   struct stereo_data *data = source->data;
+   uint64_t expirations;
+
+   UNUSED(events);
+
+   if (read(source->fd, &expirations, sizeof expirations) > 0) {
+      winsys_report(data->winsys);
+
+      report_stage_times(stage_times, "in the last 5 seconds");
+      memset(stage_times, 0, sizeof stage_times);
+   }
 }
 
-static struct stereo_renderer *
-create_renderer(const struct mode_layout *layout)
+static int
+create_stats_timer(void)
 {
-   struct stereo_renderer *renderer;
-
-   renderer = xmalloc(sizeof *renderer);
-   memset(renderer, 0, sizeof *renderer);
+   struct itimerspec interval = {
+      .it_interval = { .tv_sec = 5 },
+      .it_value = { .tv_sec = 5 },
+   };
+   int fd;
 
-   renderer->layout = *layout;
+   fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+   if (fd == -1) {
+      fprintf(stderr, "error creating timerfd: %m\n");
+      return -1;
+   }
 
-   gears_init();
-   gears_reshape(layout->virtual_eye_width, layout->virtual_eye_height);
+   timerfd_settime(fd, 0, &interval, NULL);
 
-   return renderer;
+   return fd;
 }
 
 static void
-renderer_free(struct stereo_renderer *renderer)
+latch_source_cb(struct event_source *source, uint32_t events)
 {
-   free(renderer);
+   uint64_t expirations;
+
+   UNUSED(events);
+
+   /* The timer is only read to clear it, the main loop checks the time
+    * itself */
+   if (read(source->fd, &expirations, sizeof expirations) < 0)
+      return;
 }
 
+/**
+ * Sleeps until the time to start a frame with late latching, or until
+ * an event comes in before then.
+ */
 static void
-sigint_handler(int sig)
+wait_for_latch(struct stereo_data *data, int latch_fd, uint64_t latch_ns)
 {
-   UNUSED(sig);
+   struct itimerspec deadline = {
+      .it_value = {
+         .tv_sec = latch_ns / 1000000000,
+         .tv_nsec = latch_ns % 1000000000,
+      },
+   };
+   uint64_t start = get_time_ns(), wake_ns;
 
-   quit = 1;
+   timerfd_settime(latch_fd, TFD_TIMER_ABSTIME, &deadline, NULL);
+   event_loop_dispatch(&data->loop, -1, &wake_ns);
+
+   record_stage(STAGE_WAIT_LATCH, wake_ns - start);
 }
 
 static void
 main_loop(struct stereo_data *data)
 {
-   struct sigaction action = {
-      .sa_handler = sigint_handler,
-   };
-   struct sigaction old_action;
+   int signal_fd = -1, stats_fd = -1, latch_fd = -1;
+   unsigned int n_frames = 0;
+   struct frame_times times;
+   uint64_t start, wake_ns, latch_ns = 0, target_ns = 0, present_ns;
+
+   if (event_loop_init(&data->loop))
+      return;
+
+   signal_fd = signalfd(-1, &data->signals, SFD_CLOEXEC | SFD_NONBLOCK);
+   if (signal_fd == -1) {
+      fprintf(stderr, "error creating signalfd: %m\n");
+      goto out;
+   }
+
+   stats_fd = create_stats_timer();
+   if (stats_fd == -1)
+      goto out;
+
+   latch_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+   if (latch_fd == -1) {
+      fprintf(stderr, "error creating timerfd: %m\n");
+      goto out;
+   }
+
+   if ((data->winsys->fd != -1 &&
+        event_loop_add_fd(&data->loop, &data->drm_source,
+                          data->winsys->fd, EPOLLIN,
+                          drm_source_cb, data)) ||
+       event_loop_add_fd(&data->loop, &data->signal_source,
+                         signal_fd, EPOLLIN,
+                         signal_source_cb, data) ||
+       event_loop_add_fd(&data->loop, &data->stats_source,
+                         stats_fd, EPOLLIN,
+                         stats_source_cb, data) ||
+       event_loop_add_fd(&data->loop, &data->latch_source,
+                         latch_fd, EPOLLIN,
+                         latch_source_cb, data))
+      goto out;
 
-   sigemptyset(&action.sa_mask);
-   sigaction(SIGINT, &action, &old_action);
+   while (!data->quit) {
+      /* Frames are rendered as soon as the winsys has room for one, or
+       * with late latching once it's time to start the frame for the
+       * vblank it can make. Otherwise sleep until a page flip event
+       * frees a buffer */
+      if (winsys_can_render(data->winsys)) {
+         /* The time is kept until the frame is started so that waking
+          * up just after it doesn't push the frame to the next vblank */
+         if (latch_ns == 0)
+            latch_ns = winsys_get_latch_time(data->winsys, &target_ns);
+         if (latch_ns > get_time_ns()) {
+            wait_for_latch(data, latch_fd, latch_ns);
+            continue;
+         }
 
-   while (!quit) {
-      draw(data->renderer);
-      swap(data->winsys);
+         /* A late latched frame keeps the vblank it waited for, which
+          * can be later than the next one when a frame takes longer
+          * than a refresh */
+         times.latch_ns = get_time_ns();
+         if (latch_ns != 0)
+            present_ns = target_ns;
+         else
+            present_ns = winsys_predict_present(data->winsys);
+         latch_ns = 0;
+
+         /* Without a prediction the present time is only a guess, so
+          * there is no missed target to count */
+         times.target_ns = (winsys_can_predict(data->winsys) ?
+                            present_ns : 0);
+
+         draw(data->renderer, present_ns);
+         swap(data->winsys, &times);
+         event_loop_dispatch(&data->loop, 0, NULL);
+
+         if (++n_frames == data->max_frames)
+            data->quit = true;
+      } else {
+         /* The wait ends when an event comes in. Handling it queues
+          * the next buffer, which is timed by its own stages */
+         start = get_time_ns();
+         event_loop_dispatch(&data->loop, -1, &wake_ns);
+         record_stage(STAGE_WAIT_FLIP, wake_ns - start);
+      }
    }
 
-   sigaction(SIGINT, &old_action, NULL);
+   report_stage_times(total_stage_times, "over the whole run");
+
+out:
+   if (latch_fd != -1)
+      close(latch_fd);
+   if (stats_fd != -1)
+      close(stats_fd);
+   if (signal_fd != -1)
+      close(signal_fd);
+   event_loop_fini(&data->loop);
 }
 
 static void
@@ -1648,19 +7014,51 @@ usage(void)
           "  -h              Show this help message\n"
           "  -c <connector>  Set a connector to display on\n"
           "  -d <device>     Set the DRI device to open\n"
-          "  -l <layout>     Stereo layout (none/fp/sbsf/tb/sbsh)\n");
+          "  -l <layout>     Stereo layout (none/fp/sbsf/tb/sbsh)\n"
+          "  -L              Use the legacy KMS API instead of atomic\n"
+          "  -f <frames>     Frames that may wait for scanout (1-3)\n"
+          "  -H              Render offscreen without a display\n"
+          "  -s <WxH>        Mode size to emulate with -H "
+          "(default 1920x1080)\n"
+          "  -n <frames>     Exit after rendering this many frames\n"
+          "  -S              Draw both eyes in a single instanced pass\n"
+          "  -F              Store the gear vertices as floats\n"
+          "  -g <count>      Lay out this many meshing gears\n"
+          "  -t <min>-<max>  Range of tooth counts for -g (default 10-30)\n"
+          "  -I              Draw every gear with its own draw call\n"
+          "  -z <factor>     Zoom in on the scene (default 1)\n"
+          "  -D              Draw every gear at full detail\n"
+          "  -j <threads>    Threads to build the gears on "
+          "(default: one per CPU)\n"
+          "  -C              Don't use the gear mesh cache\n"
+          "  -w              Wait to start each frame until just before "
+          "its vblank\n"
+          "  -b              Benchmark: don't wait for vblanks, using async "
+          "flips\n"
+          "                  or dropping frames\n"
+          "  -v              Use variable refresh if the display "
+          "supports it\n"
+          "\n"
+          "With -H the layout defaults to sbsh.\n");
    exit(0);
 }
 
 static int
 process_options(struct stereo_options *options, int argc, char **argv)
 {
-   static const char args[] = "-c:l:h";
+   static const char args[] = "-c:d:f:g:j:l:n:s:t:z:bCDFHILSvwh";
    int opt;
 
    memset(options, 0, sizeof *options);
 
    options->connector = 0;
+   options->frames_in_flight = 1;
+   options->headless_width = 1920;
+   options->headless_height = 1080;
+   options->min_teeth = 10;
+   options->max_teeth = 30;
+   options->zoom = 1.0f;
+   options->threads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
 
    while ((opt = getopt(argc, argv, args)) != -1) {
       switch (opt) {
@@ -1676,6 +7074,90 @@ process_options(struct stereo_options *options, int argc, char **argv)
       case 'l':
          options->stereo_layout = optarg;
          break;
+      case 'L':
+         options->legacy_kms = true;
+         break;
+      case 'H':
+         options->headless = true;
+         break;
+      case 'S':
+         options->single_pass_stereo = true;
+         break;
+      case 'F':
+         options->float_vertices = true;
+         break;
+      case 'I':
+         options->per_gear_draws = true;
+         break;
+      case 'C':
+         options->no_mesh_cache = true;
+         break;
+      case 'w':
+         options->late_latch = true;
+         break;
+      case 'b':
+         options->benchmark = true;
+         break;
+      case 'v':
+         options->vrr = true;
+         break;
+      case 'D':
+         options->full_detail = true;
+         break;
+      case 'j':
+         options->threads = atoi(optarg);
+         if (options->threads < 1) {
+            fprintf(stderr, "invalid thread count \"%s\"\n", optarg);
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'g':
+         options->n_gears = atoi(optarg);
+         if (options->n_gears < 1) {
+            fprintf(stderr, "invalid gear count \"%s\"\n", optarg);
+            return EXIT_FAILURE;
+         }
+         break;
+      case 't':
+         if (sscanf(optarg, "%d-%d",
+                    &options->min_teeth,
+                    &options->max_teeth) != 2 ||
+             options->min_teeth < 6 ||
+             options->max_teeth < options->min_teeth ||
+             options->max_teeth * VERTICES_PER_TOOTH > 65536) {
+            fprintf(stderr, "invalid tooth range \"%s\"\n", optarg);
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'z':
+         options->zoom = strtof(optarg, NULL);
+         if (!(options->zoom >= 1.0f)) {
+            fprintf(stderr, "invalid zoom \"%s\"\n", optarg);
+            return EXIT_FAILURE;
+         }
+         break;
+      case 's':
+         if (sscanf(optarg, "%ux%u",
+                    &options->headless_width,
+                    &options->headless_height) != 2 ||
+             options->headless_width == 0 ||
+             options->headless_height == 0) {
+            fprintf(stderr, "invalid mode size \"%s\"\n", optarg);
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'n':
+         options->max_frames = strtoul(optarg, NULL, 10);
+         break;
+      case 'f':
+         options->frames_in_flight = atoi(optarg);
+         if (options->frames_in_flight < 1 ||
+             options->frames_in_flight > MAX_FRAMES_IN_FLIGHT) {
+            fprintf(stderr, "frames in flight must be between 1 and %d\n",
+                    MAX_FRAMES_IN_FLIGHT);
+            return EXIT_FAILURE;
+         }
+         break;
 
       case ':':
       case '?':
@@ -1706,18 +7188,29 @@ main(int argc, char **argv)
    if (ret)
       goto out;
 
+   /* SIGINT and SIGTERM are read from a signalfd in main_loop() instead
+    * of being delivered to a handler. They have to be blocked before the
+    * GL driver starts any threads, otherwise one of those threads would
+    * receive them and kill the process */
+   sigemptyset(&data.signals);
+   sigaddset(&data.signals, SIGINT);
+   sigaddset(&data.signals, SIGTERM);
+   sigprocmask(SIG_BLOCK, &data.signals, NULL);
+
    data.winsys = create_winsys(&options);
    if (data.winsys == NULL) {
       ret = EXIT_FAILURE;
       goto out;
    }
 
-   data.renderer = create_renderer(&data.winsys->dev->layout);
+   data.renderer = create_renderer(&data.winsys->layout, &options);
    if (data.renderer == NULL) {
       ret = EXIT_FAILURE;
       goto out;
    }
 
+   data.max_frames = options.max_frames;
+
    main_loop(&data);
 
 out: